@@ -0,0 +1,172 @@
+// Packs rectangles into square pages with a skyline packer.
+//
+// Each page keeps the top edge of its filled area as a list of
+// horizontal segments, left to right. A rectangle goes wherever its
+// top would end up lowest, resting on the highest segment under it,
+// and becomes a new segment. Space hidden under an overhang is lost,
+// which wastes little when the rectangles come tallest first.
+//
+//   atlas_t atlas;
+//   init_atlas(&atlas, 1024);
+//   atlas_add(&atlas, width, height, &placed);
+//   ...
+//   free_atlas(&atlas);
+
+typedef struct
+{
+    int x;
+    int y;                      // top of the filled area under the segment
+    int width;
+} skyline_segment_t;
+
+typedef struct
+{
+    skyline_segment_t* segments;
+    int                num_segments;
+    int                used_width;      // extent of what has been placed
+    int                used_height;
+} atlas_page_t;
+
+typedef struct
+{
+    int           size;                 // width and height of every page
+    atlas_page_t* pages;
+    int           num_pages;
+} atlas_t;
+
+typedef struct
+{
+    int page;
+    int x;
+    int y;
+} atlas_place_t;
+
+void init_atlas(atlas_t* atlas, int size)
+{
+    atlas->size = size;
+    atlas->pages = NULL;
+    atlas->num_pages = 0;
+}
+
+void free_atlas(atlas_t* atlas)
+{
+    for (int i = 0; i < atlas->num_pages; i++) free(atlas->pages[i].segments);
+    free(atlas->pages);
+    init_atlas(atlas, atlas->size);
+}
+
+static void add_atlas_page(atlas_t* atlas)
+{
+    atlas->pages = (atlas_page_t*)realloc(atlas->pages, (atlas->num_pages + 1) * sizeof(atlas_page_t));
+    atlas_page_t* page = &atlas->pages[atlas->num_pages++];
+
+    // Every segment is at least one pixel wide
+    page->segments = (skyline_segment_t*)malloc((atlas->size + 1) * sizeof(skyline_segment_t));
+    page->segments[0].x = 0;
+    page->segments[0].y = 0;
+    page->segments[0].width = atlas->size;
+    page->num_segments = 1;
+    page->used_width = 0;
+    page->used_height = 0;
+}
+
+// The y a width x height rectangle would have with its left edge at
+// segment 'index', or -1 if it doesn't fit there.
+static int skyline_fit(const atlas_page_t* page, int size, int index, int width, int height)
+{
+    const skyline_segment_t* segments = page->segments;
+    if (segments[index].x + width > size) return -1;
+
+    int y = 0;
+    for (int left = width; left > 0; left -= segments[index++].width)
+    {
+        y = MAX(y, segments[index].y);
+        if (y + height > size) return -1;
+    }
+    return y;
+}
+
+static void skyline_insert(atlas_page_t* page, int index, int x, int y, int width, int height)
+{
+    skyline_segment_t* segments = page->segments;
+    memmove(&segments[index + 1], &segments[index], (page->num_segments - index) * sizeof(skyline_segment_t));
+    page->num_segments++;
+    segments[index].x = x;
+    segments[index].y = y + height;
+    segments[index].width = width;
+
+    // Cut away what the new segment covers of the ones after it
+    int right = x + width;
+    while (index + 1 < page->num_segments && segments[index + 1].x < right)
+    {
+        skyline_segment_t* next = &segments[index + 1];
+        int covered = MIN(right - next->x, next->width);
+        next->x += covered;
+        next->width -= covered;
+        if (next->width > 0) break;
+        memmove(next, next + 1, (page->num_segments - index - 2) * sizeof(skyline_segment_t));
+        page->num_segments--;
+    }
+
+    // Merge neighbours at the same height
+    for (int i = 0; i + 1 < page->num_segments; )
+    {
+        if (segments[i].y == segments[i + 1].y)
+        {
+            segments[i].width += segments[i + 1].width;
+            memmove(&segments[i + 1], &segments[i + 2], (page->num_segments - i - 2) * sizeof(skyline_segment_t));
+            page->num_segments--;
+        }
+        else i++;
+    }
+
+    page->used_width = MAX(page->used_width, right);
+    page->used_height = MAX(page->used_height, y + height);
+}
+
+// Place a width x height rectangle on the first page it fits on,
+// starting a new page if it fits on none of them.
+void atlas_add(atlas_t* atlas, int width, int height, atlas_place_t* place)
+{
+    if (width > atlas->size || height > atlas->size) fatal("%dx%d doesn't fit in a %d atlas", width, height, atlas->size);
+
+    for (int p = 0; ; p++)
+    {
+        if (p == atlas->num_pages) add_atlas_page(atlas);
+        atlas_page_t* page = &atlas->pages[p];
+
+        // Lowest top edge, then leftmost
+        int best = -1;
+        int best_y = 0;
+        for (int i = 0; i < page->num_segments; i++)
+        {
+            int y = skyline_fit(page, atlas->size, i, width, height);
+            if (y >= 0 && (best < 0 || y < best_y))
+            {
+                best = i;
+                best_y = y;
+            }
+        }
+        if (best < 0) continue;
+
+        place->page = p;
+        place->x = page->segments[best].x;
+        place->y = best_y;
+        skyline_insert(page, best, place->x, place->y, width, height);
+        return;
+    }
+}
+
+static int next_power_of_two(int value)
+{
+    int result = 1;
+    while (result < value) result *= 2;
+    return result;
+}
+
+// The smallest power of two width and height holding all of a page.
+void atlas_page_size(const atlas_t* atlas, int page, int* width, int* height)
+{
+    *width = next_power_of_two(atlas->pages[page].used_width);
+    *height = next_power_of_two(atlas->pages[page].used_height);
+}
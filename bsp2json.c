@@ -4,20 +4,64 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <float.h>
+#include <math.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "utils.c"
+#include "pak.c"
+#include "vfs.c"
+#include "mesh.c"
+#include "ftoa.c"
+#include "writer.c"
+#include "kernels.c"
+#include "atlas.c"
+#include "compress.c"
 
-FILE* create_output_file(const char* base, const char* description)
+#define PVS_BITS 1
+#define PVS_RLE  2
+
+typedef struct
+{
+    int binary;             // write raw vertex/index blobs instead of JSON arrays
+    int weld;               // share vertices between faces where possible
+    int index32;            // one 32 bit index space instead of 16 bit chunks, always so for JSON
+    int output_fd;          // every output goes here as framed records (see writer.c), or -1
+    int num_threads;        // to convert faces with
+    const char* kernels;    // force "scalar", "sse" or "avx2", or NULL for the best
+    int lightmap_atlas;     // pack the lightmaps into pages and give vertices UVs into them
+    int textures;           // decode the map's textures through gfx/palette.lmp
+    int indexed;            // keep textures as palette indices and write the palette
+    int compress;           // a bit per block_formats entry to compress textures to
+    int quality;            // of the compression, QUALITY_FAST to QUALITY_BEST
+    int pvs;                // export leaves and their visibility, PVS_BITS or PVS_RLE, or 0
+    int leaf_ranges;        // order the world's triangles leaf by leaf
+    int nodes;              // export the BSP trees flattened, with the triangles in node order
+} options_t;
+
+// 'name' is the output file name without the base, e.g. "vertices.json"
+void create_output_file(writer_t* writer, const char* base, const char* name, const options_t* options)
 {
     char* filename;
-    int error = asprintf(&filename, "%s.%s.json", base, description);
+    int error = asprintf(&filename, "%s.%s", base, name);
     if (error < 0) fatal("Unable to compute output filename");
-    puts(filename);
-    FILE* result = fopen(filename, "w");
-    if(!result) fatal("Error opening %s", filename);
-    return result;
+    if (options->output_fd >= 0) writer_open_framed(writer, options->output_fd, filename);
+    else writer_open(writer, filename);
+    free(filename);
+}
+
+void close_output_file(writer_t* writer)
+{
+    printf("%s: %" PRIu64 " bytes\n", writer->filename, writer->bytes + writer->used);
+    writer_close(writer);
 }
 
 typedef struct                 // A Directory entry
@@ -146,6 +190,8 @@ typedef struct                 // Mip Texture
   uint32_t offset8;              // offset to u_char Pix[width/8 * height/8]
 } miptex_t;
 
+#define MIP_LEVELS 4
+
 typedef struct
 {
     boundbox_t bound;            // The bounding box of the Model
@@ -171,81 +217,472 @@ typedef struct
     uint32_t   animated;      // 0 for ordinary textures, 1 for water 
 } texinfo_t;
 
+// A face found by walking the BSP trees
 typedef struct
 {
-    int first_vertex;
-    int first_index;
-    FILE* vertices_out;
-    FILE* indices_out;
-    FILE* entities_out;
+    int face_id;
+    int model;
+} face_ref_t;
+
+typedef struct
+{
+    face_ref_t*   faces;                // in the order they were visited
+    uint32_t      num_faces;
+    uint32_t      max_faces;
+    int           model;                // the model being visited
+    void*         stack;                // node_visit_t, for node_to_json()
+    int           max_stack;
 }  traversal_t;
 
-static float*       vertices        = NULL;
-static int          num_vertices    = 0;
-static face_t*      _faces          = NULL;
-static int          _num_faces      = 0;
-static edge_t*      edges           = NULL;
-static int          num_edges       = 0;
-static int32_t*     list_edges      = NULL;
-static int          num_list_edges  = 0;
-static plane_t*     planes          = NULL;
-static int          num_planes      = 0;
-static miptex_t*    miptextures     = NULL;
-static int          num_miptextures = 0;
-static node_t*      nodes           = NULL;
-static int          num_nodes       = 0;
-static model_t*     models          = NULL;
-static int          num_models      = 0;
-static uint8_t*     lightmaps       = NULL;
-static int          num_lightmaps   = 0;
-static texinfo_t*   _texinfos       = NULL;
-static int          _num_texinfos   = 0;
-static char*        entities        = NULL;
-static int          num_entities    = 0;
+// The corners of the face being converted, gathered as structure of
+// arrays for the kernels, and what they work out from them.
+typedef struct
+{
+    int       capacity;
+    uint32_t* vertex;                   // index into the vertex lump
+    float*    x;
+    float*    y;
+    float*    z;
+    float*    s;                        // texture coordinates
+    float*    t;
+    float*    light;                    // 0 (dark) to 1, from the lightmap
+    float*    luxel_s;                  // position in the face's lightmap, in luxels
+    float*    luxel_t;
+    float     st_mins[2];               // extents of its texture coordinates
+    float     st_maxs[2];
+} face_stage_t;
+
+// Where a face's light comes from and, with an atlas, where it went.
+typedef struct
+{
+    int           offset;               // of its lightmap in the lump, or -1 for none
+    int           num_styles;
+    int           fullbright;           // lit all over without a lightmap
+    int           width;                // in luxels
+    int           height;
+    uint32_t      first_vertex;         // its vertices in the batch's mesh
+    uint32_t      num_vertices;
+    atlas_place_t place;                // of luxel (0, 0)
+} face_lightmap_t;
+
+// A run of consecutive faces, converted into a mesh of its own. Runs
+// are converted in parallel and then appended to the map's mesh in
+// order, so the result doesn't depend on the number of threads.
+typedef struct
+{
+    const face_ref_t* faces;
+    uint32_t      num_faces;
+    mesh_t        mesh;
+    int           weld;
+    weld_key_t*   weld_keys;            // of each vertex of 'mesh' when welding
+    uint32_t      max_weld_keys;
+    face_lightmap_t* lightmaps;         // of each face, with a lightmap atlas
+    face_stage_t  stage;
+} face_batch_t;
+
+// The lumps of one map, pointing into its file. Everything converting
+// a map reads comes from here, so maps can be converted side by side.
+typedef struct
+{
+    const float*     vertices;
+    int              num_vertices;
+    const face_t*    faces;
+    int              num_faces;
+    const edge_t*    edges;
+    int              num_edges;
+    const int32_t*   list_edges;
+    int              num_list_edges;
+    const plane_t*   planes;
+    int              num_planes;
+    const char*      miptex;            // a count, offsets from here, then the textures
+    int              miptex_size;
+    const int32_t*   miptex_offsets;
+    int              num_miptextures;
+    const node_t*    nodes;
+    int              num_nodes;
+    const dleaf_t*   leaves;
+    int              num_leaves;
+    const uint16_t*  leaf_faces;
+    int              num_leaf_faces;
+    const uint8_t*   visibility;        // run length encoded rows, one per leaf
+    int              num_visibility;
+    const model_t*   models;
+    int              num_models;
+    const uint8_t*   lightmaps;
+    int              num_lightmaps;
+    const texinfo_t* texinfos;
+    int              num_texinfos;
+    const char*      entities;
+    int              num_entities;
+} bsp_context_t;
+
+// Print one problem found while validating a map, up to a limit so a
+// thoroughly broken file doesn't bury the rest of the output.
+static void report_invalid(int* errors, const char* format, ...)
+{
+    if (++*errors > 100) return;
+
+    va_list argp;
+    va_start(argp, format);
+    fprintf(stderr, "  ");
+    vfprintf(stderr, format, argp);
+    fputs("\n", stderr);
+    va_end(argp);
+}
+
+static void fail_validation(const char* name, int errors)
+{
+    if (errors > 100) fprintf(stderr, "  ... and %d more\n", errors - 100);
+    fatal("%s is not a valid BSP: %d problem%s found", name, errors, errors == 1 ? "" : "s");
+}
 
-static edge_t* get_edge(int index)
+// Point 'bsp' at the lumps of the map in 'data', after checking that
+// they all lie within its 'size' bytes.
+static void init_bsp_context(bsp_context_t* bsp, const char* name, const char* data, size_t size)
 {
-    if (index >= num_edges) fatal("Invalid edge index %d", index);
-    if (index < 0) fatal("Negative edge index");
-    return edges + index;
+    static const char* lump_names[] =
+    {
+        "entities", "planes", "miptex", "vertices", "visilist", "nodes", "texinfo", "faces",
+        "lightmaps", "clipnodes", "leaves", "lface", "edges", "ledges", "models"
+    };
+
+    if (size < sizeof(dheader_t)) fatal("%s is too small to be a BSP", name);
+    const dheader_t* header = (const dheader_t*)data;
+
+    int errors = 0;
+    const dentry_t* lumps = &header->entities;
+    for (int i = 0; i < 15; i++)
+    {
+        if (lumps[i].offset < 0 || lumps[i].size < 0 || (uint64_t)lumps[i].offset + lumps[i].size > size)
+        {
+            report_invalid(&errors, "%s lump (%d bytes at %d) is outside the file", lump_names[i], lumps[i].size, lumps[i].offset);
+        }
+    }
+    if (errors) fail_validation(name, errors);
+
+    bsp->num_vertices = header->vertices.size / sizeof(float);
+    bsp->vertices = (const float*)(data + header->vertices.offset);
+
+    bsp->num_edges = header->edges.size / sizeof(edge_t);
+    bsp->edges = (const edge_t*)(data + header->edges.offset);
+
+    bsp->num_list_edges = header->ledges.size / sizeof(int32_t);
+    bsp->list_edges = (const int32_t*)(data + header->ledges.offset);
+
+    bsp->num_planes = header->planes.size / sizeof(plane_t);
+    bsp->planes = (const plane_t*)(data + header->planes.offset);
+
+    bsp->num_faces = header->faces.size / sizeof(face_t);
+    bsp->faces = (const face_t*)(data + header->faces.offset);
+
+    bsp->num_nodes = header->nodes.size / sizeof(node_t);
+    bsp->nodes = (const node_t*)(data + header->nodes.offset);
+
+    bsp->num_leaves = header->leaves.size / sizeof(dleaf_t);
+    bsp->leaves = (const dleaf_t*)(data + header->leaves.offset);
+
+    bsp->num_leaf_faces = header->lface.size / sizeof(uint16_t);
+    bsp->leaf_faces = (const uint16_t*)(data + header->lface.offset);
+
+    bsp->num_visibility = header->visilist.size / sizeof(uint8_t);
+    bsp->visibility = (const uint8_t*)(data + header->visilist.offset);
+
+    bsp->num_models = header->models.size / sizeof(model_t);
+    bsp->models = (const model_t*)(data + header->models.offset);
+
+    // Not an array of miptex_t but a directory of them
+    bsp->miptex = data + header->miptex.offset;
+    bsp->miptex_size = header->miptex.size;
+    bsp->miptex_offsets = (const int32_t*)(bsp->miptex + sizeof(int32_t));
+    bsp->num_miptextures = bsp->miptex_size >= 4 ? *(const int32_t*)bsp->miptex : 0;
+    if (bsp->num_miptextures < 0 || (bsp->num_miptextures && ((int64_t)bsp->num_miptextures + 1) * 4 > bsp->miptex_size))
+    {
+        report_invalid(&errors, "miptex directory of %d textures doesn't fit its %d bytes", bsp->num_miptextures, bsp->miptex_size);
+        fail_validation(name, errors);
+    }
+
+    bsp->num_texinfos = header->texinfo.size / sizeof(texinfo_t);
+    bsp->texinfos = (const texinfo_t*)(data + header->texinfo.offset);
+
+    bsp->num_lightmaps = header->lightmaps.size / sizeof(uint8_t);
+    bsp->lightmaps = (const uint8_t*)(data + header->lightmaps.offset);
+
+    bsp->num_entities = header->entities.size / sizeof(char);
+    bsp->entities = (const char*)(data + header->entities.offset);
 }
 
-static face_t* get_face(int index)
+// Check every index one lump holds into another, once, so that the
+// conversion can follow them without checking each access. Reports all
+// the problems found rather than just the first.
+static int is_finite_vertex(const vertex_t* v)
 {
-    if (index >= _num_faces) fatal("Invalid face index %d", index);
-    if (index < 0) fatal("Negative face index");
-    return _faces + index;
+    return isfinite(v->x) && isfinite(v->y) && isfinite(v->z);
 }
 
-static texinfo_t* get_texinfo(int index)
+static void validate_bsp(const bsp_context_t* bsp, const char* name)
 {
-    //printf("Get texture [%ld] %d of %d\n", sizeof(texinfo_t), index, _num_texinfos);
-    if (index >= _num_texinfos) fatal("Invalid texinfo index %d\n", index);
-    if (index < 0) fatal("negative texinfo index %d", index);
-    return &_texinfos[index];
+    int errors = 0;
+
+    // NaN and infinity can't be written as JSON numbers
+    int num_points = bsp->num_vertices / 3;
+    for (int i = 0; i < num_points; i++)
+    {
+        if (!is_finite_vertex((const vertex_t*)&bsp->vertices[i * 3])) report_invalid(&errors, "vertex %d isn't finite", i);
+    }
+    for (int i = 0; i < bsp->num_planes; i++)
+    {
+        const plane_t* plane = &bsp->planes[i];
+        if (!is_finite_vertex(&plane->normal) || !isfinite(plane->dist)) report_invalid(&errors, "plane %d isn't finite", i);
+    }
+
+    for (int i = 0; i < bsp->num_edges; i++)
+    {
+        const edge_t* edge = &bsp->edges[i];
+        if (edge->vertex0 >= num_points || edge->vertex1 >= num_points)
+        {
+            report_invalid(&errors, "edge %d: vertices %d, %d out of %d", i, edge->vertex0, edge->vertex1, num_points);
+        }
+    }
+
+    for (int i = 0; i < bsp->num_list_edges; i++)
+    {
+        int32_t edge = bsp->list_edges[i];
+        if (edge == INT32_MIN || abs(edge) >= bsp->num_edges)
+        {
+            report_invalid(&errors, "edge list %d: edge %d out of %d", i, edge, bsp->num_edges);
+        }
+    }
+
+    // Textures left out of the map have an offset of -1
+    for (int i = 0; i < bsp->num_miptextures; i++)
+    {
+        int32_t offset = bsp->miptex_offsets[i];
+        if (offset == -1) continue;
+        if (offset < 0 || (int64_t)offset + sizeof(miptex_t) > (uint64_t)bsp->miptex_size)
+        {
+            report_invalid(&errors, "texture %d: offset %d out of %d", i, offset, bsp->miptex_size);
+            continue;
+        }
+
+        const miptex_t* miptex = (const miptex_t*)(bsp->miptex + offset);
+        if (!miptex->width || !miptex->height || miptex->width % 8 || miptex->height % 8)
+        {
+            report_invalid(&errors, "texture %d: %ux%u isn't a multiple of 8", i, miptex->width, miptex->height);
+            continue;
+        }
+        const uint32_t* mips = &miptex->offset1;
+        for (int level = 0; level < MIP_LEVELS; level++)
+        {
+            uint64_t end = (uint64_t)offset + mips[level] + (uint64_t)(miptex->width >> level) * (miptex->height >> level);
+            if (end > (uint64_t)bsp->miptex_size) report_invalid(&errors, "texture %d: mip level %d out of the lump", i, level);
+        }
+    }
+
+    for (int i = 0; i < bsp->num_texinfos; i++)
+    {
+        const texinfo_t* texinfo = &bsp->texinfos[i];
+        if (!is_finite_vertex(&texinfo->vectorS) || !isfinite(texinfo->distS) ||
+            !is_finite_vertex(&texinfo->vectorT) || !isfinite(texinfo->distT))
+        {
+            report_invalid(&errors, "texinfo %d isn't finite", i);
+        }
+        if (bsp->texinfos[i].texture_id >= (uint32_t)bsp->num_miptextures)
+        {
+            report_invalid(&errors, "texinfo %d: texture %u out of %d", i, bsp->texinfos[i].texture_id, bsp->num_miptextures);
+        }
+    }
+
+    for (int i = 0; i < bsp->num_faces; i++)
+    {
+        const face_t* face = &bsp->faces[i];
+        if (face->plane_id < 0 || face->plane_id >= bsp->num_planes)
+        {
+            report_invalid(&errors, "face %d: plane %d out of %d", i, face->plane_id, bsp->num_planes);
+        }
+        if (face->ledge_id < 0 || face->ledge_num < 0 || (int64_t)face->ledge_id + face->ledge_num > bsp->num_list_edges)
+        {
+            report_invalid(&errors, "face %d: edges %d to %d out of %d", i, face->ledge_id, face->ledge_id + face->ledge_num, bsp->num_list_edges);
+        }
+        if (face->texinfo_id < 0 || face->texinfo_id >= bsp->num_texinfos)
+        {
+            report_invalid(&errors, "face %d: texinfo %d out of %d", i, face->texinfo_id, bsp->num_texinfos);
+        }
+        if (face->lightmap < -1 || face->lightmap >= bsp->num_lightmaps)
+        {
+            report_invalid(&errors, "face %d: lightmap offset %d out of %d", i, face->lightmap, bsp->num_lightmaps);
+        }
+    }
+
+    for (int i = 0; i < bsp->num_nodes; i++)
+    {
+        const node_t* node = &bsp->nodes[i];
+        if (node->plane_id < 0 || node->plane_id >= bsp->num_planes)
+        {
+            report_invalid(&errors, "node %d: plane %d out of %d", i, node->plane_id, bsp->num_planes);
+        }
+        if (node->face_id + node->face_num > bsp->num_faces)
+        {
+            report_invalid(&errors, "node %d: faces %d to %d out of %d", i, node->face_id, node->face_id + node->face_num, bsp->num_faces);
+        }
+
+        uint16_t children[2] = { node->front, node->back };
+        for (int k = 0; k < 2; k++)
+        {
+            if (children[k] & 0x8000)
+            {
+                int leaf = (uint16_t)~children[k];
+                if (leaf >= bsp->num_leaves) report_invalid(&errors, "node %d: leaf %d out of %d", i, leaf, bsp->num_leaves);
+            }
+            else if (children[k] >= bsp->num_nodes)
+            {
+                report_invalid(&errors, "node %d: child node %d out of %d", i, children[k], bsp->num_nodes);
+            }
+        }
+    }
+
+    for (int i = 0; i < bsp->num_leaves; i++)
+    {
+        const dleaf_t* leaf = &bsp->leaves[i];
+        if (leaf->vislist < -1 || leaf->vislist >= bsp->num_visibility)
+        {
+            report_invalid(&errors, "leaf %d: visibility offset %d out of %d", i, leaf->vislist, bsp->num_visibility);
+        }
+        if (leaf->lface_id + leaf->lface_num > bsp->num_leaf_faces)
+        {
+            report_invalid(&errors, "leaf %d: faces %d to %d out of %d", i, leaf->lface_id, leaf->lface_id + leaf->lface_num, bsp->num_leaf_faces);
+        }
+    }
+
+    for (int i = 0; i < bsp->num_leaf_faces; i++)
+    {
+        if (bsp->leaf_faces[i] >= bsp->num_faces)
+        {
+            report_invalid(&errors, "leaf face list %d: face %d out of %d", i, bsp->leaf_faces[i], bsp->num_faces);
+        }
+    }
+
+    if (bsp->num_models < 1) report_invalid(&errors, "no models");
+    else if (bsp->models[0].numleafs < 0 || bsp->models[0].numleafs >= bsp->num_leaves)
+    {
+        // Leaves with visibility, not counting leaf 0
+        report_invalid(&errors, "world model: %d leaves out of %d", bsp->models[0].numleafs, bsp->num_leaves);
+    }
+    for (int i = 0; i < bsp->num_models; i++)
+    {
+        const model_t* model = &bsp->models[i];
+        if (model->node_id0 < 0 || model->node_id0 >= bsp->num_nodes)
+        {
+            report_invalid(&errors, "model %d: node %d out of %d", i, model->node_id0, bsp->num_nodes);
+        }
+        if (!is_finite_vertex(&model->origin) || !is_finite_vertex(&model->bound.min) || !is_finite_vertex(&model->bound.max))
+        {
+            report_invalid(&errors, "model %d isn't finite", i);
+        }
+    }
+
+    if (errors) fail_validation(name, errors);
 }
-void set_min(vertex_t* out, vertex_t* a, vertex_t* b)
+
+// The texture at 'index' in the miptex directory, or NULL for one left
+// out of the map.
+static const miptex_t* get_miptex(const bsp_context_t* bsp, int index)
 {
-    out->x = MIN(a->x, b->x);
-    out->y = MIN(a->y, b->y);
-    out->z = MIN(a->z, b->z);
+    int32_t offset = bsp->miptex_offsets[index];
+    return offset == -1 ? NULL : (const miptex_t*)(bsp->miptex + offset);
 }
 
-void set_max(vertex_t* out, vertex_t* a, vertex_t* b)
+static void grow_stage(face_stage_t* stage, int capacity)
 {
-    out->x = MAX(a->x, b->x);
-    out->y = MAX(a->y, b->y);
-    out->z = MAX(a->z, b->z);
+    // One block, vertex first so that freeing it frees the lot
+    stage->capacity = MAX(capacity, stage->capacity * 2);
+    stage->vertex = realloc(stage->vertex, stage->capacity * (sizeof(uint32_t) + 8 * sizeof(float)));
+    stage->x = (float*)&stage->vertex[stage->capacity];
+    stage->y = stage->x + stage->capacity;
+    stage->z = stage->y + stage->capacity;
+    stage->s = stage->z + stage->capacity;
+    stage->t = stage->s + stage->capacity;
+    stage->light = stage->t + stage->capacity;
+    stage->luxel_s = stage->light + stage->capacity;
+    stage->luxel_t = stage->luxel_s + stage->capacity;
 }
 
+#define TEX_SPECIAL     1       // texinfo flag of sky and liquids, which have no lightmap
+#define MAX_LIGHTMAPS   4       // light styles per face
+#define MAX_EXTENT      33      // luxels along either side of a lightmap, as GLQuake allows
 
-float dotproduct(vertex_t a, vertex_t b)
+// Light the staged corners of 'face' from its lightmap, which has a
+// luxel every 16 texels from floor(min s / 16) to ceil(max s / 16),
+// and the same along t. Each corner samples it bilinearly, adding up
+// all the face's light styles as the engine does at normal brightness.
+static void light_face(const bsp_context_t* bsp, const face_t* face, const texinfo_t* texture, face_stage_t* stage, int count, face_lightmap_t* lightmap)
 {
-    float result = 0;
-    result += a.x * b.x;
-    result += a.y * b.y;
-    result += a.z * b.z;
-    return result;
+    lightmap->offset = -1;
+    lightmap->num_styles = 0;
+    lightmap->width = 1;
+    lightmap->height = 1;
+
+    // Sky and liquids are drawn fullbright, as is a map without light
+    lightmap->fullbright = (texture->animated & TEX_SPECIAL) || !bsp->num_lightmaps;
+
+    int s_min = 0, t_min = 0, width = 0, height = 0;
+    if (count > 0 && !lightmap->fullbright)
+    {
+        s_min = (int)floorf(stage->st_mins[0] / 16);
+        t_min = (int)floorf(stage->st_mins[1] / 16);
+        width = (int)ceilf(stage->st_maxs[0] / 16) - s_min + 1;
+        height = (int)ceilf(stage->st_maxs[1] / 16) - t_min + 1;
+
+        // The four style bytes, the first 255 ends the list
+        const uint8_t styles[MAX_LIGHTMAPS] = { face->typelight, face->baselight, face->light[0], face->light[1] };
+        int num_styles = 0;
+        while (num_styles < MAX_LIGHTMAPS && styles[num_styles] != 255) num_styles++;
+
+        if (face->lightmap >= 0 && num_styles > 0 && width <= MAX_EXTENT && height <= MAX_EXTENT &&
+            face->lightmap + (int64_t)width * height * num_styles <= bsp->num_lightmaps)
+        {
+            lightmap->offset = face->lightmap;
+            lightmap->num_styles = num_styles;
+            lightmap->width = width;
+            lightmap->height = height;
+        }
+    }
+
+    if (lightmap->offset < 0)
+    {
+        for (int e = 0; e < count; e++)
+        {
+            stage->light[e] = lightmap->fullbright;
+            stage->luxel_s[e] = 0;
+            stage->luxel_t[e] = 0;
+        }
+        return;
+    }
+
+    const uint8_t* maps = bsp->lightmaps + lightmap->offset;
+    int size = width * height;
+    for (int e = 0; e < count; e++)
+    {
+        float u = MIN(MAX(stage->s[e] / 16 - s_min, 0), width - 1);
+        float v = MIN(MAX(stage->t[e] / 16 - t_min, 0), height - 1);
+        int x0 = (int)u;
+        int y0 = (int)v;
+        int x1 = MIN(x0 + 1, width - 1);
+        int y1 = MIN(y0 + 1, height - 1);
+        float fx = u - x0;
+        float fy = v - y0;
+
+        float sum = 0;
+        for (int style = 0; style < lightmap->num_styles; style++)
+        {
+            const uint8_t* map = maps + style * size;
+            float top    = map[y0 * width + x0] * (1 - fx) + map[y0 * width + x1] * fx;
+            float bottom = map[y1 * width + x0] * (1 - fx) + map[y1 * width + x1] * fx;
+            sum += top * (1 - fy) + bottom * fy;
+        }
+        stage->light[e] = MIN(sum, 255) / 255.0f;
+        stage->luxel_s[e] = u;
+        stage->luxel_t[e] = v;
+    }
 }
 
 /*
@@ -265,220 +702,1488 @@ static void print_texture(texinfo_t* t)
 }
 */
 
-static void face_to_json(int face_id, int* index_base, traversal_t* traversal)
+static void face_to_json(const bsp_context_t* bsp, const face_ref_t* ref, face_batch_t* batch)
 {
-    //printf("Processing face %08x\n", face_id);
+    //printf("Processing face %08x\n", ref->face_id);
 
-    const face_t* face = get_face(face_id);
-    vertex_t* verts = (vertex_t*)vertices;    
-    int32_t* first_edge = list_edges +  face->ledge_id;
-    
-    plane_t* plane = planes + face->plane_id;
-    
-    int light = face->lightmap;
-    
-    float color = 0;
-    
-    //printf("light: %d\n", light);
-    
-    if (light > 0) color = (lightmaps[light] /* - face->baselight*/) / 255.0f;
+    const face_t* face = &bsp->faces[ref->face_id];
+    const vertex_t* verts = (const vertex_t*)bsp->vertices;
+    const int32_t* first_edge = bsp->list_edges +  face->ledge_id;
     
-    vertex_t minv, maxv;
-    minv.x = minv.y = minv.z = FLT_MAX;
-    maxv.x = maxv.y = maxv.z = FLT_MIN;
-    
-    for (int e=0; e<face->ledge_num; e++)
-    {
-        edge_t* edge = get_edge(abs(first_edge[e]));
-        set_max(&maxv, &maxv, &verts[edge->vertex0]);
-        set_max(&maxv, &maxv, &verts[edge->vertex1]);
-        set_min(&minv, &minv, &verts[edge->vertex0]);
-        set_min(&minv, &minv, &verts[edge->vertex1]);
-    }
-    
-    vertex_t extents;
-    extents.x = maxv.x - minv.x;
-    extents.y = maxv.y - minv.y;
-    extents.z = maxv.z - minv.z;
-    
-    //printf("extents: %g %g %g\n", extents.x/16.0f, extents.y/16.0f, extents.z/16.0f);
-    
-    texinfo_t* texture = get_texinfo(face->texinfo_id);
-    
-    //print_texture(texture);
+    const plane_t* plane = bsp->planes + face->plane_id;
     
-    for (int e=0; e<face->ledge_num; e++)
+    // Gather the corners in winding order
+    face_stage_t* stage = &batch->stage;
+    int count = face->ledge_num;
+    if (count > stage->capacity) grow_stage(stage, count);
+
+    for (int e=0; e<count; e++)
     {
-        if (!traversal->first_vertex) fprintf(traversal->vertices_out, ",\n");
-        traversal->first_vertex = 0;
         int32_t edge_index = first_edge[e];
-        int v0, v1;
+        int v0;
         if (edge_index > 0)
         {
-            edge_t* edge = get_edge(edge_index);
+            const edge_t* edge = &bsp->edges[edge_index];
             v0 = edge->vertex0;
-            v1 = edge->vertex1;
         }
         else // swap winding
         {
-            edge_t* edge = get_edge(-edge_index);
+            const edge_t* edge = &bsp->edges[-edge_index];
             v0 = edge->vertex1;
-            v1 = edge->vertex0;
-        }
-        
-        float s = dotproduct(verts[v0], texture->vectorS) + texture->distS;    
-        float t = dotproduct(verts[v0], texture->vectorT) + texture->distT;
-
-        fprintf(traversal->vertices_out, "%g, %g, %g, %g, %g, %g, %g, %g, %g, %g, %g, 1",
-            verts[v0].x,
-            verts[v0].y,
-            verts[v0].z,
-            plane->normal.x,
-            plane->normal.y,
-            plane->normal.z,
-            color,
-            color,
-            color,
-            s,
-            t);
+        }
+        stage->vertex[e] = v0;
+        stage->x[e] = verts[v0].x;
+        stage->y[e] = verts[v0].y;
+        stage->z[e] = verts[v0].z;
+    }
+    
+    const texinfo_t* texture = &bsp->texinfos[face->texinfo_id];
+    
+    //print_texture(texture);
 
+    const float s_axis[4] = { texture->vectorS.x, texture->vectorS.y, texture->vectorS.z, texture->distS };
+    const float t_axis[4] = { texture->vectorT.x, texture->vectorT.y, texture->vectorT.z, texture->distT };
+    kernels.project(stage->x, stage->y, stage->z, count, s_axis, stage->s);
+    kernels.project(stage->x, stage->y, stage->z, count, t_axis, stage->t);
+
+    if (count > 0)
+    {
+        kernels.range(stage->s, count, &stage->st_mins[0], &stage->st_maxs[0]);
+        kernels.range(stage->t, count, &stage->st_mins[1], &stage->st_maxs[1]);
     }
+
+    face_lightmap_t unused;
+    face_lightmap_t* lightmap = batch->lightmaps ? &batch->lightmaps[ref - batch->faces] : &unused;
+    light_face(bsp, face, texture, stage, count, lightmap);
+
+    mesh_t* mesh = &batch->mesh;
+    uint32_t first_vertex = mesh->num_vertices;
+    lightmap->first_vertex = first_vertex;
+    lightmap->num_vertices = count;
     
-    int base = *index_base;
+    for (int e=0; e<count; e++)
+    {
+        // Welding waits until the batches are merged, just record
+        // what makes this vertex the same as another.
+        if (batch->weld)
+        {
+            if (mesh->num_vertices == batch->max_weld_keys)
+            {
+                batch->max_weld_keys = MAX(1024, batch->max_weld_keys * 2);
+                batch->weld_keys = realloc(batch->weld_keys, batch->max_weld_keys * sizeof(weld_key_t));
+            }
+            weld_key_t* key = &batch->weld_keys[mesh->num_vertices];
+            key->vertex    = stage->vertex[e];
+            key->texinfo   = face->texinfo_id;
+            key->normal[0] = plane->normal.x;
+            key->normal[1] = plane->normal.y;
+            key->normal[2] = plane->normal.z;
+            key->light     = stage->light[e];
+            key->face      = batch->lightmaps ? ref->face_id : 0;
+        }
+
+        float* vertex = mesh_add_vertex(mesh);
+        vertex[0]  = stage->x[e];
+        vertex[1]  = stage->y[e];
+        vertex[2]  = stage->z[e];
+        vertex[3]  = plane->normal.x;
+        vertex[4]  = plane->normal.y;
+        vertex[5]  = plane->normal.z;
+        vertex[6]  = stage->light[e];
+        vertex[7]  = stage->light[e];
+        vertex[8]  = stage->light[e];
+        vertex[9]  = stage->s[e];
+        vertex[10] = stage->t[e];
+        vertex[11] = 1;
+
+        // Placed in the atlas once all the faces have been converted
+        if (mesh->stride == LIGHTMAP_VERTEX_FLOATS)
+        {
+            vertex[12] = stage->luxel_s[e];
+            vertex[13] = stage->luxel_t[e];
+        }
+    }
     
+    mesh_begin_draw(mesh, ref->model, texture->texture_id);
     for (int f=1; f < face->ledge_num - 1; f++)
     {
-        if (!traversal->first_index) fprintf(traversal->indices_out, ",\n");
-        traversal->first_index = 0;
-        fprintf(traversal->indices_out, "%d, %d, %d",
-            base,
-            base + f,
-            base + f + 1);
+        mesh_add_triangle(mesh, first_vertex, first_vertex + f, first_vertex + f + 1);
     }
-    (*index_base) = base + face->ledge_num;
-    
+    mesh_end_draw(mesh);
 }
 
-static void node_to_json(int node_id, int* index_base, traversal_t* traversal);
-
-static void node_leaf_index_to_json(int index, int* index_base, traversal_t* traversal)
+// Children with bit 15 set are leaves, and node 0 is always a root
+static int is_child_node(int index)
 {
     const static unsigned leaf_mask = 0x8000;
-    if (index & leaf_mask) return;
-    if (index == 0) return;
-    node_to_json(index, index_base, traversal);
+    return !(index & leaf_mask) && index != 0;
 }
 
-static void node_to_json(int node_id, int* index_base, traversal_t* traversal)
+typedef struct
 {
-    //printf("Processing node %d\n", node_id);
-    
-    node_t* node = nodes + node_id;
+    int node_id;
+    int front_done;     // the front subtree has been visited
+} node_visit_t;
 
-    //printf("Node: plane %08x faces: %d first: %08x front %08x back %08x\n",
-    //node->plane_id, node->face_num, node->face_id, node->front, node->back);
-
-    node_leaf_index_to_json(node->front, index_base, traversal);
+static void add_face(traversal_t* traversal, int face_id)
+{
+    if (traversal->num_faces == traversal->max_faces)
+    {
+        traversal->max_faces = MAX(1024, traversal->max_faces * 2);
+        traversal->faces = realloc(traversal->faces, traversal->max_faces * sizeof(face_ref_t));
+    }
+    face_ref_t* ref = &traversal->faces[traversal->num_faces++];
+    ref->face_id = face_id;
+    ref->model = traversal->model;
+}
 
-    for (int i = 0; i< node->face_num; i++)
+// Collect the faces of the tree under 'root' in order: front subtree,
+// the node's own faces, then the back subtree. An explicit stack keeps
+// deep trees from running out of C stack.
+static void node_to_json(const bsp_context_t* bsp, int root, traversal_t* traversal)
+{
+    if (bsp->num_nodes > traversal->max_stack)
     {
-        face_to_json(node->face_id + i, index_base, traversal);
+        traversal->max_stack = bsp->num_nodes;
+        traversal->stack = realloc(traversal->stack, bsp->num_nodes * sizeof(node_visit_t));
     }
+    node_visit_t* stack = traversal->stack;
+    int depth = 0;
+
+    // A tree visits each node at most once, so any more than that
+    // means the file has a cycle in it. This also bounds the stack.
+    int pushed = 1;
+
+    stack[depth].node_id = root;
+    stack[depth].front_done = 0;
+    depth++;
+
+    while (depth > 0)
+    {
+        node_visit_t* visit = &stack[depth - 1];
+        const node_t* node = bsp->nodes + visit->node_id;
 
-    node_leaf_index_to_json(node->back, index_base, traversal);
+        //printf("Node: plane %08x faces: %d first: %08x front %08x back %08x\n",
+        //node->plane_id, node->face_num, node->face_id, node->front, node->back);
+
+        if (!visit->front_done)
+        {
+            visit->front_done = 1;
+            if (is_child_node(node->front))
+            {
+                if (++pushed > bsp->num_nodes) fatal("Node %d is its own descendant", node->front);
+                stack[depth].node_id = node->front;
+                stack[depth].front_done = 0;
+                depth++;
+            }
+            continue;
+        }
+
+        depth--;
+
+        for (int i = 0; i< node->face_num; i++)
+        {
+            add_face(traversal, node->face_id + i);
+        }
+
+        if (is_child_node(node->back))
+        {
+            if (++pushed > bsp->num_nodes) fatal("Node %d is its own descendant", node->back);
+            stack[depth].node_id = node->back;
+            stack[depth].front_done = 0;
+            depth++;
+        }
+    }
 }
 
-static void nodes_to_json(traversal_t* traversal)
+// The world is model 0, and the brush entities (doors, platforms and
+// so on) are the rest, referred to by entities as "*1", "*2" ...
+static void nodes_to_json(const bsp_context_t* bsp, traversal_t* traversal)
 {   
-    printf("Num faces: %d\n", _num_faces);
-        
-    fwrite(entities, 1, num_entities, traversal->entities_out);
-    
-    fprintf(traversal->vertices_out, "{ \"vertices\" : [ ");
-    fprintf(traversal->indices_out,  "{ \"indices\"  : [ ");
-    
-    int index_base = 0;
+    printf("Num faces: %d\n", bsp->num_faces);
     
     printf("Model[0] origin: %g %g %g\n",
-        models[0].origin.x,
-        models[0].origin.y,
-        models[0].origin.z);
-    
-    int bsp_root = models[0].node_id0;
+        bsp->models[0].origin.x,
+        bsp->models[0].origin.y,
+        bsp->models[0].origin.z);
 
-    node_to_json(bsp_root, &index_base, traversal);
-  
-    fprintf(traversal->vertices_out, "] }\n");
-    fprintf(traversal->indices_out,  "] }\n");    
+    for (int i = 0; i < bsp->num_models; i++)
+    {
+        traversal->model = i;
+        node_to_json(bsp, bsp->models[i].node_id0, traversal);
+    }
 }
 
-static void to_json(const char* file)
+// Run 'worker' on up to 'num_threads' threads, this one included, and
+// wait for them all to return.
+static void run_workers(int num_threads, void* (*worker)(void*), void* argument)
 {
-    char* data = read_entire_file(file);
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    for (int i = 1; i < num_threads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, argument)) fatal("Unable to start thread");
+    }
+    worker(argument);
+    for (int i = 1; i < num_threads; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
 
-    dheader_t* header = (dheader_t*)data;
-    printf("Reading %s BSP version %d\n", file, header->version);
-    
-    num_vertices = header->vertices.size / sizeof(float);
-    vertices = (float*)(data + header->vertices.offset);
+#define FACES_PER_BATCH 1024
 
-    num_edges = header->edges.size / sizeof(edge_t);
-    edges = (edge_t*)(data + header->edges.offset);
-    
-    num_list_edges = header->ledges.size / sizeof(uint16_t);
-    list_edges = (int32_t*)(data + header->ledges.offset);
-    
-    num_planes = header->planes.size / sizeof(plane_t);
-    planes = (plane_t*)(data + header->planes.offset);
+typedef struct
+{
+    const bsp_context_t* bsp;
+    face_batch_t*    batches;
+    uint32_t         num_batches;
+    uint32_t         next_batch;
+    pthread_mutex_t  lock;
+} batch_queue_t;
 
-    _num_faces = header->faces.size / sizeof(face_t);
-    _faces = (face_t*)(data + header->faces.offset);
-    
-    num_nodes = header->nodes.size / sizeof(node_t);
-    nodes = (node_t*)(data + header->nodes.offset);
-    
-    num_models = header->models.size / sizeof(model_t);
-    models = (model_t*)(data + header->models.offset);
-    
-    // Bug here? wrong size of miptex struct?
-    num_miptextures = header->miptex.size / sizeof(miptex_t);
-    miptextures = (miptex_t*)(data + header->miptex.offset);
+static void* convert_worker(void* argument)
+{
+    batch_queue_t* queue = argument;
 
-    for (int i=0; i<num_miptextures; i++)
+    for (;;)
     {
-        char name_data[17] = {};
-        strncpy(name_data, miptextures[i].name, 16);
-        printf("Texture: %s\n", name_data);
+        pthread_mutex_lock(&queue->lock);
+        uint32_t index = queue->next_batch++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->num_batches) break;
+
+        face_batch_t* batch = &queue->batches[index];
+        for (uint32_t i = 0; i < batch->num_faces; i++) face_to_json(queue->bsp, &batch->faces[i], batch);
     }
-    
-    _num_texinfos = header->texinfo.size / sizeof(texinfo_t);
-    _texinfos = (texinfo_t*)(data + header->texinfo.offset);
-    
-    num_lightmaps = header->lightmaps.size / sizeof(uint8_t);
-    lightmaps = (uint8_t*)(data + header->lightmaps.offset);
-    
-    num_entities = header->entities.size / sizeof(char);
-    entities = (char*)(data + header->entities.offset);
-    
-    traversal_t traversal;
-    traversal.first_index  = 1;
-    traversal.first_vertex = 1;
-    traversal.vertices_out = create_output_file(file, "vertices");
-    traversal.indices_out  = create_output_file(file, "indices");
-    traversal.entities_out = create_output_file(file, "entities");
-    nodes_to_json(&traversal);
-    fclose(traversal.entities_out);
-    fclose(traversal.vertices_out);
-    fclose(traversal.indices_out);
+    return NULL;
+}
+
+#define LIGHTMAP_PAGE_SIZE 1024
+
+typedef struct
+{
+    int      width;
+    int      height;
+    uint8_t* pixels;            // a byte per luxel, all styles added up
+} lightmap_page_t;
+
+typedef struct
+{
+    lightmap_page_t* pages;
+    int              num_pages;
+} lightmap_atlas_t;
+
+typedef struct
+{
+    int              width;
+    int              height;
+    uint32_t         order;     // to keep the sort stable
+    face_lightmap_t* lightmap;
+} lightmap_block_t;
+
+// Tallest first, which is what the skyline packer does best with.
+static int compare_blocks(const void* a, const void* b)
+{
+    const lightmap_block_t* x = a;
+    const lightmap_block_t* y = b;
+    if (x->height != y->height) return x->height > y->height ? -1 : 1;
+    if (x->width != y->width) return x->width > y->width ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
 
-    //textures_to_json();
+// Copy a face's lightmap into its page with a one luxel border that
+// repeats its edges, so filtering never reaches a neighbour's light.
+static void fill_lightmap_block(const bsp_context_t* bsp, const face_lightmap_t* lightmap, lightmap_page_t* page)
+{
+    const uint8_t* maps = bsp->lightmaps + lightmap->offset;
+    int size = lightmap->width * lightmap->height;
 
-    free(data);
+    for (int y = -1; y <= lightmap->height; y++)
+    {
+        int v = MIN(MAX(y, 0), lightmap->height - 1);
+        uint8_t* row = &page->pixels[(lightmap->place.y + y) * page->width + lightmap->place.x];
+        for (int x = -1; x <= lightmap->width; x++)
+        {
+            int u = MIN(MAX(x, 0), lightmap->width - 1);
+            int sum = 0;
+            for (int style = 0; style < lightmap->num_styles; style++) sum += maps[style * size + v * lightmap->width + u];
+            row[x] = MIN(sum, 255);
+        }
+    }
 }
 
-int main(int argc, char** argv)
+// Pack the lightmaps of every face in the batches into pages, then
+// point each vertex's lightmap texcoord and each draw at its page.
+// Faces without a lightmap share a white or a black luxel.
+static void pack_lightmaps(const bsp_context_t* bsp, face_batch_t* batches, uint32_t num_batches, lightmap_atlas_t* result)
 {
-    if (argc < 2) fatal("Usage: %s <filename.bsp>\n", argv[0]);
-    for (int i=1; i<argc; i++) to_json(argv[i]);
+    uint32_t num_faces = 0;
+    for (uint32_t i = 0; i < num_batches; i++) num_faces += batches[i].num_faces;
+
+    lightmap_block_t* blocks = malloc((num_faces + 1) * sizeof(lightmap_block_t));
+    uint32_t num_blocks = 0;
+    for (uint32_t i = 0; i < num_batches; i++)
+    {
+        for (uint32_t f = 0; f < batches[i].num_faces; f++)
+        {
+            face_lightmap_t* lightmap = &batches[i].lightmaps[f];
+            if (lightmap->offset < 0) continue;
+            lightmap_block_t* block = &blocks[num_blocks];
+            block->width = lightmap->width + 2;
+            block->height = lightmap->height + 2;
+            block->order = num_blocks++;
+            block->lightmap = lightmap;
+        }
+    }
+    qsort(blocks, num_blocks, sizeof(lightmap_block_t), compare_blocks);
+
+    atlas_t atlas;
+    init_atlas(&atlas, LIGHTMAP_PAGE_SIZE);
+
+    atlas_place_t white, black;
+    atlas_add(&atlas, 3, 3, &white);
+    atlas_add(&atlas, 3, 3, &black);
+    for (uint32_t i = 0; i < num_blocks; i++)
+    {
+        face_lightmap_t* lightmap = blocks[i].lightmap;
+        atlas_add(&atlas, blocks[i].width, blocks[i].height, &lightmap->place);
+        lightmap->place.x++;
+        lightmap->place.y++;
+    }
+    free(blocks);
+
+    result->num_pages = atlas.num_pages;
+    result->pages = malloc(atlas.num_pages * sizeof(lightmap_page_t));
+    for (int i = 0; i < atlas.num_pages; i++)
+    {
+        lightmap_page_t* page = &result->pages[i];
+        atlas_page_size(&atlas, i, &page->width, &page->height);
+        page->pixels = calloc(page->width * page->height, 1);
+    }
+    free_atlas(&atlas);
+
+    // Black is already there, the pages start out zeroed
+    const lightmap_page_t* white_page = &result->pages[white.page];
+    for (int y = 0; y < 3; y++) memset(&white_page->pixels[(white.y + y) * white_page->width + white.x], 255, 3);
+    white.x++;
+    white.y++;
+    black.x++;
+    black.y++;
+
+    for (uint32_t i = 0; i < num_batches; i++)
+    {
+        face_batch_t* batch = &batches[i];
+        for (uint32_t f = 0; f < batch->num_faces; f++)
+        {
+            face_lightmap_t* lightmap = &batch->lightmaps[f];
+            if (lightmap->offset >= 0) fill_lightmap_block(bsp, lightmap, &result->pages[lightmap->place.page]);
+            else lightmap->place = lightmap->fullbright ? white : black;
+
+            // Luxel positions become texcoords at the luxel centres
+            const lightmap_page_t* page = &result->pages[lightmap->place.page];
+            for (uint32_t v = lightmap->first_vertex; v < lightmap->first_vertex + lightmap->num_vertices; v++)
+            {
+                float* vertex = &batch->mesh.vertices[v * batch->mesh.stride];
+                vertex[12] = (lightmap->place.x + vertex[12] + 0.5f) / page->width;
+                vertex[13] = (lightmap->place.y + vertex[13] + 0.5f) / page->height;
+            }
+
+            // Each face is one draw
+            batch->mesh.draws[f].lightmap = lightmap->place.page;
+        }
+    }
+}
+
+static void free_lightmap_atlas(lightmap_atlas_t* atlas)
+{
+    for (int i = 0; i < atlas->num_pages; i++) free(atlas->pages[i].pixels);
+    free(atlas->pages);
+    atlas->pages = NULL;
+    atlas->num_pages = 0;
+}
+
+// Convert the faces found by the traversal into 'mesh', on up to
+// 'num_threads' threads. Batches are appended in order and welded as
+// they are, which gives the same vertices and indices as converting
+// the faces one after the other on a single thread. With a lightmap
+// atlas, its pages go to 'lightmaps'.
+static void faces_to_mesh(const bsp_context_t* bsp, const traversal_t* traversal, mesh_t* mesh, lightmap_atlas_t* lightmaps, const options_t* options)
+{
+    batch_queue_t queue;
+    queue.bsp = bsp;
+    queue.num_batches = (traversal->num_faces + FACES_PER_BATCH - 1) / FACES_PER_BATCH;
+    queue.batches = calloc(queue.num_batches, sizeof(face_batch_t));
+    queue.next_batch = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    for (uint32_t i = 0; i < queue.num_batches; i++)
+    {
+        face_batch_t* batch = &queue.batches[i];
+        batch->faces = &traversal->faces[i * FACES_PER_BATCH];
+        batch->num_faces = MIN(FACES_PER_BATCH, traversal->num_faces - i * FACES_PER_BATCH);
+        batch->weld = options->weld;
+        init_mesh(&batch->mesh, mesh->stride);
+        if (options->lightmap_atlas) batch->lightmaps = malloc(batch->num_faces * sizeof(face_lightmap_t));
+    }
+
+    run_workers(MAX(1, MIN(options->num_threads, (int)queue.num_batches)), convert_worker, &queue);
+    pthread_mutex_destroy(&queue.lock);
+
+    // Serially, so the packing doesn't depend on the threads
+    if (options->lightmap_atlas) pack_lightmaps(bsp, queue.batches, queue.num_batches, lightmaps);
+
+    weld_table_t welds;
+    init_weld_table(&welds, options->weld ? bsp->num_vertices / 3 * 4 : 0);
+    uint32_t* remap = NULL;
+    uint32_t max_remap = 0;
+    uint32_t num_corners = 0;
+
+    for (uint32_t i = 0; i < queue.num_batches; i++)
+    {
+        face_batch_t* batch = &queue.batches[i];
+        num_corners += batch->mesh.num_vertices;
+
+        if (batch->weld)
+        {
+            if (batch->mesh.num_vertices > max_remap)
+            {
+                max_remap = batch->mesh.num_vertices;
+                remap = realloc(remap, max_remap * sizeof(uint32_t));
+            }
+            for (uint32_t v = 0; v < batch->mesh.num_vertices; v++)
+            {
+                remap[v] = weld_vertex(&welds, &batch->weld_keys[v], mesh->num_vertices);
+                if (remap[v] != mesh->num_vertices) continue;
+                memcpy(mesh_add_vertex(mesh), &batch->mesh.vertices[v * mesh->stride], mesh->stride * sizeof(float));
+            }
+        }
+        mesh_append(mesh, &batch->mesh, batch->weld ? remap : NULL);
+
+        free_mesh(&batch->mesh);
+        free(batch->weld_keys);
+        free(batch->lightmaps);
+        free(batch->stage.vertex);
+    }
+
+    if (options->weld)
+    {
+        printf("Welded %u face vertices down to %u\n", num_corners, mesh->num_vertices);
+    }
+
+    free(remap);
+    free_weld_table(&welds);
+    free(queue.batches);
+}
+
+// Repeat each of the world's faces for every leaf that lists it in
+// lface, in leaf order and then lface order, so that batching leaves a
+// contiguous range of triangles per leaf. Faces seen from several
+// leaves are drawn from each of them, sharing their vertices. World
+// faces no leaf lists go to leaf 0, as do the other models' faces.
+static void order_by_leaf(const bsp_context_t* bsp, const traversal_t* traversal, mesh_t* mesh)
+{
+    // Each face found by the traversal made one draw, in order
+    int32_t* face_draws = malloc(bsp->num_faces * sizeof(int32_t));
+    uint8_t* listed = calloc(bsp->num_faces, 1);
+    for (int i = 0; i < bsp->num_faces; i++) face_draws[i] = -1;
+    for (uint32_t i = 0; i < traversal->num_faces; i++)
+    {
+        if (traversal->faces[i].model == 0) face_draws[traversal->faces[i].face_id] = i;
+    }
+
+    // Leaves' face lists may overlap, so count what they list rather
+    // than going by the size of the lump
+    uint32_t max_draws = traversal->num_faces;
+    for (int leaf = 1; leaf < bsp->num_leaves; leaf++) max_draws += bsp->leaves[leaf].lface_num;
+    uint32_t* order = malloc(max_draws * sizeof(uint32_t));
+    uint32_t* leaves = malloc(max_draws * sizeof(uint32_t));
+    uint32_t count = 0;
+    for (int leaf = 1; leaf < bsp->num_leaves; leaf++)
+    {
+        const dleaf_t* source = &bsp->leaves[leaf];
+        for (int i = source->lface_id; i < source->lface_id + source->lface_num; i++)
+        {
+            int face = bsp->leaf_faces[i];
+            if (face_draws[face] < 0) continue;
+            order[count] = face_draws[face];
+            leaves[count++] = leaf;
+            listed[face] = 1;
+        }
+    }
+    for (uint32_t i = 0; i < traversal->num_faces; i++)
+    {
+        const face_ref_t* ref = &traversal->faces[i];
+        if (ref->model == 0 && listed[ref->face_id]) continue;
+        order[count] = i;
+        leaves[count++] = 0;
+    }
+
+    printf("Ordered %u faces into %u leaf draws\n", traversal->num_faces, count);
+    select_draws(mesh, order, leaves, count);
+
+    free(leaves);
+    free(order);
+    free(listed);
+    free(face_draws);
+}
+
+// The nodes of every model's tree, depth first: a node, then its front
+// subtree, then its back subtree. A subtree is a run of records, and the
+// draws are sorted by record, so its triangles are a run of indices too.
+typedef struct
+{
+    const node_t* node;
+    int32_t       children[2];  // record of the front and back nodes, or -1 - leaf
+    uint32_t      next;         // the record after the subtree
+} flat_node_t;
+
+typedef struct
+{
+    flat_node_t* records;
+    uint32_t     num_records;
+    uint32_t     max_records;
+    uint32_t*    model_roots;   // the records of model i start at model_roots[i]
+    uint32_t*    face_records;  // the record of the node holding each face
+} node_tree_t;
+
+typedef struct
+{
+    int node_id;
+    int parent;                 // record, or -1 for the root
+    int side;                   // 0 front, 1 back
+} node_push_t;
+
+static void flatten_nodes(const bsp_context_t* bsp, node_tree_t* tree)
+{
+    tree->records = NULL;
+    tree->num_records = 0;
+    tree->max_records = 0;
+    tree->model_roots = malloc(bsp->num_models * sizeof(uint32_t));
+    tree->face_records = calloc(bsp->num_faces, sizeof(uint32_t));
+    node_push_t* stack = malloc(bsp->num_nodes * sizeof(node_push_t));
+
+    for (int m = 0; m < bsp->num_models; m++)
+    {
+        tree->model_roots[m] = tree->num_records;
+
+        // Bounded the same way as node_to_json()
+        int pushed = 1;
+        int depth = 0;
+        stack[depth].node_id = bsp->models[m].node_id0;
+        stack[depth].parent = -1;
+        stack[depth].side = 0;
+        depth++;
+
+        while (depth > 0)
+        {
+            node_push_t push = stack[--depth];
+            if (tree->num_records == tree->max_records)
+            {
+                tree->max_records = MAX(256, tree->max_records * 2);
+                tree->records = realloc(tree->records, tree->max_records * sizeof(flat_node_t));
+            }
+            uint32_t index = tree->num_records++;
+            if (push.parent >= 0) tree->records[push.parent].children[push.side] = index;
+
+            flat_node_t* record = &tree->records[index];
+            const node_t* node = bsp->nodes + push.node_id;
+            record->node = node;
+            for (int i = node->face_id; i < node->face_id + node->face_num; i++) tree->face_records[i] = index;
+
+            // Back first, so the front comes off the stack next
+            uint16_t children[2] = { node->front, node->back };
+            for (int k = 1; k >= 0; k--)
+            {
+                // Node 0 can't be a child, there's nothing there, as in solid leaf 0
+                record->children[k] = children[k] & 0x8000 ? -1 - (int32_t)(uint16_t)~children[k] : -1;
+                if (!is_child_node(children[k])) continue;
+                if (++pushed > bsp->num_nodes) fatal("Node %d is its own descendant", children[k]);
+                stack[depth].node_id = children[k];
+                stack[depth].parent = index;
+                stack[depth].side = k;
+                depth++;
+            }
+        }
+    }
+
+    // Children come after their parents
+    for (uint32_t i = tree->num_records; i-- > 0; )
+    {
+        flat_node_t* record = &tree->records[i];
+        int32_t last = record->children[1] >= 0 ? record->children[1] : record->children[0];
+        record->next = last >= 0 ? tree->records[last].next : i + 1;
+    }
+
+    free(stack);
+}
+
+static void free_node_tree(node_tree_t* tree)
+{
+    free(tree->records);
+    free(tree->model_roots);
+    free(tree->face_records);
+}
+
+// Tag each face's draw with the record of its node, for batch_draws()
+// to sort by. Each face found by the traversal made one draw, in order.
+static void tag_node_draws(const node_tree_t* tree, const traversal_t* traversal, mesh_t* mesh)
+{
+    for (uint32_t i = 0; i < traversal->num_faces; i++)
+    {
+        mesh->draws[i].node = tree->face_records[traversal->faces[i].face_id];
+    }
+}
+
+// Decimal digits of 'value' at 'out', returns how many.
+static int format_uint(uint32_t value, char* out)
+{
+    char digits[10];
+    int length = 0;
+    do digits[length++] = '0' + value % 10; while (value /= 10);
+    for (int i = 0; i < length; i++) out[i] = digits[length - 1 - i];
+    return length;
+}
+
+static void write_json_mesh(const mesh_t* mesh, const char* base, const options_t* options)
+{
+    writer_t vertices_out;
+    create_output_file(&vertices_out, base, "vertices.json", options);
+    writer_printf(&vertices_out, "{ \"vertices\" : [ ");
+    for (uint32_t i = 0; i < mesh->num_vertices; i++)
+    {
+        // Shortest digits that read back as the same float, %g would
+        // round to six significant digits.
+        const float* v = &mesh->vertices[i * mesh->stride];
+        char* line = writer_reserve(&vertices_out, mesh->stride * 18 + 2);
+        int length = 0;
+        if (i)
+        {
+            line[length++] = ',';
+            line[length++] = '\n';
+        }
+        for (uint32_t k = 0; k < mesh->stride; k++)
+        {
+            if (k)
+            {
+                line[length++] = ',';
+                line[length++] = ' ';
+            }
+            // Finite maps can still overflow, e.g. with huge texture scales
+            if (!isfinite(v[k])) fatal("Vertex %u: %g can't be written as JSON", i, v[k]);
+            length += format_float(v[k], &line[length]);
+        }
+        writer_commit(&vertices_out, length);
+    }
+    writer_printf(&vertices_out, "] }\n");
+    close_output_file(&vertices_out);
+
+    writer_t indices_out;
+    create_output_file(&indices_out, base, "indices.json", options);
+    writer_printf(&indices_out, "{ \"indices\"  : [ ");
+    for (uint32_t i = 0; i < mesh->num_indices; i += 3)
+    {
+        const uint32_t* triangle = &mesh->indices[i];
+        char* line = writer_reserve(&indices_out, 3 * 12 + 2);
+        int length = 0;
+        if (i)
+        {
+            line[length++] = ',';
+            line[length++] = '\n';
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            if (k)
+            {
+                line[length++] = ',';
+                line[length++] = ' ';
+            }
+            length += format_uint(triangle[k], &line[length]);
+        }
+        writer_commit(&indices_out, length);
+    }
+    writer_printf(&indices_out, "] }\n");
+    close_output_file(&indices_out);
+}
+
+static uint32_t little_endian32(uint32_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+// Write 'count' 32 bit values as little endian, or just the low
+// 16 bits of each when 'bytes' is 2.
+static void write_little_endian(writer_t* output, const void* data, uint32_t count, int bytes)
+{
+    const uint32_t* values = data;
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Already in the right layout, skip the copy into the buffer
+    if (bytes == 4)
+    {
+        writer_write(output, values, count * sizeof(uint32_t));
+        return;
+    }
+#endif
+
+    for (uint32_t i = 0; i < count; )
+    {
+        uint32_t batch = MIN(count - i, 4096);
+        uint8_t* buffer = (uint8_t*)writer_reserve(output, batch * bytes);
+        for (uint32_t end = i + batch; i < end; i++)
+        {
+            if (bytes == 2)
+            {
+                *buffer++ = values[i] & 0xff;
+                *buffer++ = (values[i] >> 8) & 0xff;
+            }
+            else
+            {
+                uint32_t value = little_endian32(values[i]);
+                memcpy(buffer, &value, 4);
+                buffer += 4;
+            }
+        }
+        writer_commit(output, batch * bytes);
+    }
+}
+
+static const char* file_name_only(const char* path)
+{
+    const char* last_sep = strrchr(path, '/');
+    return last_sep ? last_sep + 1 : path;
+}
+
+// Little endian interleaved float32 vertices and uint16 (or uint32
+// when they don't fit) indices, described by a small JSON manifest.
+static void write_binary_mesh(const mesh_t* mesh, const char* base, const options_t* options)
+{
+    writer_t vertices_out;
+    create_output_file(&vertices_out, base, "vertices.bin", options);
+    write_little_endian(&vertices_out, mesh->vertices, mesh->num_vertices * mesh->stride, 4);
+    close_output_file(&vertices_out);
+
+    writer_t indices_out;
+    create_output_file(&indices_out, base, "indices.bin", options);
+    write_little_endian(&indices_out, mesh->indices, mesh->num_indices, options->index32 ? 4 : 2);
+    close_output_file(&indices_out);
+}
+
+// The pages one after the other, a byte per luxel.
+static void write_lightmaps(const lightmap_atlas_t* lightmaps, const char* base, const options_t* options)
+{
+    writer_t lightmaps_out;
+    create_output_file(&lightmaps_out, base, "lightmaps.bin", options);
+    for (int i = 0; i < lightmaps->num_pages; i++)
+    {
+        const lightmap_page_t* page = &lightmaps->pages[i];
+        writer_write(&lightmaps_out, page->pixels, page->width * page->height);
+    }
+    close_output_file(&lightmaps_out);
+}
+
+// Bytes in a row of visibility, with a bit for each of the world's
+// leaves after leaf 0, which is solid and never visible.
+static int pvs_row_bytes(const bsp_context_t* bsp)
+{
+    return (bsp->models[0].numleafs + 7) / 8;
+}
+
+// Expand a leaf's row of visibility from 'in' into 'out'. A zero byte
+// is followed by how many zero bytes it stands for, anything else is
+// as it is. Literals go eight at a time up to the next zero, found
+// with a bit trick on the whole word. Rows cut short by the end of
+// the lump leave the rest of the leaves hidden.
+static void decompress_vis(const uint8_t* in, const uint8_t* end, uint8_t* out, int row_bytes)
+{
+    const uint64_t low_bits = 0x7f7f7f7f7f7f7f7full;
+    uint8_t* out_end = out + row_bytes;
+
+    while (out < out_end && in < end)
+    {
+        if (end - in >= 8 && out_end - out >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, in, 8);
+
+            // The high bit of each zero byte
+            uint64_t zeros = ~(((word & low_bits) + low_bits) | word | low_bits);
+            int literals = 8;
+            if (zeros)
+            {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                literals = __builtin_clzll(zeros) / 8;
+#else
+                literals = __builtin_ctzll(zeros) / 8;
+#endif
+            }
+            memcpy(out, in, literals);
+            in += literals;
+            out += literals;
+            if (literals == 8) continue;
+        }
+        else if (*in)
+        {
+            *out++ = *in++;
+            continue;
+        }
+
+        // A run of zeros
+        int run = in + 1 < end ? in[1] : 0;
+        in += 2;
+        run = MIN(run, out_end - out);
+        memset(out, 0, run);
+        out += run;
+    }
+    memset(out, 0, out_end - out);
+}
+
+// Runs of 0x00 and of 0xff bytes become the byte and a count up to
+// 255, other bytes stay as they are. Returns the encoded size, which
+// is at most twice 'row_bytes'.
+static int compress_vis(const uint8_t* row, int row_bytes, uint8_t* out)
+{
+    uint8_t* start = out;
+    for (int i = 0; i < row_bytes; )
+    {
+        uint8_t value = row[i];
+        if (value != 0 && value != 0xff)
+        {
+            *out++ = row[i++];
+            continue;
+        }
+        int run = 1;
+        while (i + run < row_bytes && row[i + run] == value && run < 255) run++;
+        *out++ = value;
+        *out++ = run;
+        i += run;
+    }
+    return out - start;
+}
+
+#define LEAF_WORDS 11
+
+// Every leaf with its bounds, its faces and its row of visibility, for
+// culling what the camera's leaf can't see. Leaf 0, and leaves without
+// visibility, see everything, as in Quake. The rows are bitsets, bit j
+// for leaf j + 1, or with PVS_RLE each is run length encoded.
+static void leaves_to_json(const bsp_context_t* bsp, const char* base, const options_t* options)
+{
+    int num_visible = bsp->models[0].numleafs;
+    int row_bytes = pvs_row_bytes(bsp);
+    uint8_t* row = malloc(row_bytes + 1);
+    uint8_t* packed = malloc(row_bytes * 2 + 1);
+    uint32_t* records = malloc(bsp->num_leaves * LEAF_WORDS * sizeof(uint32_t));
+
+    writer_t pvs_out;
+    create_output_file(&pvs_out, base, "pvs.bin", options);
+    uint32_t offset = 0;
+    for (int i = 0; i < bsp->num_leaves; i++)
+    {
+        const dleaf_t* leaf = &bsp->leaves[i];
+        if (i == 0 || leaf->vislist < 0)
+        {
+            memset(row, 0, row_bytes);
+            memset(row, 0xff, num_visible / 8);
+            if (num_visible % 8) row[num_visible / 8] = (1 << (num_visible % 8)) - 1;
+        }
+        else decompress_vis(bsp->visibility + leaf->vislist, bsp->visibility + bsp->num_visibility, row, row_bytes);
+
+        uint32_t size = row_bytes;
+        if (options->pvs == PVS_RLE)
+        {
+            size = compress_vis(row, row_bytes, packed);
+            writer_write(&pvs_out, packed, size);
+        }
+        else writer_write(&pvs_out, row, row_bytes);
+
+        uint32_t* record = &records[i * LEAF_WORDS];
+        record[0] = leaf->type;
+        for (int k = 0; k < 3; k++)
+        {
+            record[1 + k] = (int32_t)leaf->bound.min[k];
+            record[4 + k] = (int32_t)leaf->bound.max[k];
+        }
+        record[7] = leaf->lface_id;
+        record[8] = leaf->lface_num;
+        record[9] = offset;
+        record[10] = size;
+        offset += size;
+    }
+    close_output_file(&pvs_out);
+
+    writer_t leaves_out;
+    create_output_file(&leaves_out, base, "leaves.bin", options);
+    write_little_endian(&leaves_out, records, bsp->num_leaves * LEAF_WORDS, 4);
+    close_output_file(&leaves_out);
+
+    uint32_t* faces = malloc(bsp->num_leaf_faces * sizeof(uint32_t));
+    for (int i = 0; i < bsp->num_leaf_faces; i++) faces[i] = bsp->leaf_faces[i];
+    writer_t faces_out;
+    create_output_file(&faces_out, base, "leaf_faces.bin", options);
+    write_little_endian(&faces_out, faces, bsp->num_leaf_faces, 2);
+    close_output_file(&faces_out);
+
+    free(faces);
+    free(records);
+    free(packed);
+    free(row);
+}
+
+#define NODE_BYTES 40
+
+// 'bytes' of 'value' at 'out', least significant first.
+static void store_little_endian(uint8_t* out, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) out[i] = (value >> (8 * i)) & 0xff;
+}
+
+// One NODE_BYTES record per node, laid out as listed in the manifest.
+// The index range of a record covers its whole subtree, and begins with
+// the triangles of the node's own faces.
+static void write_nodes(const node_tree_t* tree, const mesh_t* mesh, const char* base, const options_t* options)
+{
+    // Where the triangles of each record start, the draws being in record order
+    uint32_t* starts = malloc((tree->num_records + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0, d = 0; i <= tree->num_records; i++)
+    {
+        while (d < mesh->num_draws && mesh->draws[d].node < i) d++;
+        starts[i] = d < mesh->num_draws ? mesh->draws[d].first_index : mesh->num_indices;
+    }
+
+    uint8_t* records = malloc(MAX(tree->num_records, 1) * NODE_BYTES);
+    for (uint32_t i = 0; i < tree->num_records; i++)
+    {
+        const flat_node_t* record = &tree->records[i];
+        const node_t* node = record->node;
+        uint8_t* out = &records[i * NODE_BYTES];
+        for (int k = 0; k < 3; k++)
+        {
+            store_little_endian(&out[k * 2], (uint16_t)node->box.min[k], 2);
+            store_little_endian(&out[6 + k * 2], (uint16_t)node->box.max[k], 2);
+        }
+        store_little_endian(&out[12], (uint32_t)record->children[0], 4);
+        store_little_endian(&out[16], (uint32_t)record->children[1], 4);
+        store_little_endian(&out[20], record->next, 4);
+        store_little_endian(&out[24], node->face_id, 2);
+        store_little_endian(&out[26], node->face_num, 2);
+        store_little_endian(&out[28], starts[i], 4);
+        store_little_endian(&out[32], starts[record->next] - starts[i], 4);
+        store_little_endian(&out[36], starts[i + 1] - starts[i], 4);
+    }
+
+    writer_t nodes_out;
+    create_output_file(&nodes_out, base, "nodes.bin", options);
+    writer_write(&nodes_out, records, tree->num_records * NODE_BYTES);
+    close_output_file(&nodes_out);
+
+    free(records);
+    free(starts);
+}
+
+// From the search path, or a loose file extracted by unpak.
+static void load_palette(vfs_t* vfs, uint8_t palette[256 * 3])
+{
+    vfs_file_t file;
+    if (!vfs_open(vfs, "gfx/palette.lmp", &file, MADV_SEQUENTIAL)) fatal("Unable to find gfx/palette.lmp to decode the textures");
+    if (file.size < 256 * 3) fatal("gfx/palette.lmp is too small");
+    memcpy(palette, file.data, 256 * 3);
+    vfs_close_file(&file);
+}
+
+typedef struct
+{
+    int       num_textures;
+    uint32_t* offsets;          // of each texture's mip levels in the file, MIP_LEVELS apiece
+    uint32_t* block_offsets;    // the same in the compressed files, which all lay out alike
+} texture_file_t;
+
+static void decode_texels(const uint8_t* pixels, uint32_t count, const uint8_t colors[256][4], uint8_t* out)
+{
+    for (uint32_t p = 0; p < count; p++, out += 4) memcpy(out, colors[pixels[p]], 4);
+}
+
+typedef struct
+{
+    const bsp_context_t* bsp;
+    const uint8_t  (*colors)[4];
+    const uint32_t*  block_offsets;
+    uint8_t*         blocks[BLOCK_FORMATS];
+    int              formats;
+    int              quality;
+    uint32_t         num_jobs;          // one per mip level of each texture
+    uint32_t         next_job;
+    pthread_mutex_t  lock;
+} compress_queue_t;
+
+static void* compress_worker(void* argument)
+{
+    compress_queue_t* queue = argument;
+    uint8_t* rgba = NULL;
+    uint32_t max_rgba = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        uint32_t job = queue->next_job++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (job >= queue->num_jobs) break;
+
+        const miptex_t* miptex = get_miptex(queue->bsp, job / MIP_LEVELS);
+        if (!miptex) continue;
+        int level = job % MIP_LEVELS;
+        int width = miptex->width >> level;
+        int height = miptex->height >> level;
+        if ((uint32_t)(width * height * 4) > max_rgba)
+        {
+            max_rgba = width * height * 4;
+            rgba = realloc(rgba, max_rgba);
+        }
+        decode_texels((const uint8_t*)miptex + (&miptex->offset1)[level], width * height, queue->colors, rgba);
+
+        for (int f = 0; f < BLOCK_FORMATS; f++)
+        {
+            if (!(queue->formats & (1 << f))) continue;
+            compress_image(&block_formats[f], queue->quality, rgba, width, height, queue->blocks[f] + queue->block_offsets[job]);
+        }
+    }
+    free(rgba);
+    return NULL;
+}
+
+// Every mip level of every texture in each of the block formats asked
+// for, to <base>.textures.dxt1 and so on, laid out like textures.bin.
+static void compress_textures(const bsp_context_t* bsp, const uint8_t colors[256][4], const char* base, const options_t* options, texture_file_t* textures)
+{
+    compress_queue_t queue;
+    queue.bsp = bsp;
+    queue.colors = colors;
+    queue.formats = options->compress;
+    queue.quality = options->quality;
+    queue.num_jobs = bsp->num_miptextures * MIP_LEVELS;
+    queue.next_job = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    textures->block_offsets = malloc(queue.num_jobs * sizeof(uint32_t));
+    uint32_t size = 0;
+    for (uint32_t job = 0; job < queue.num_jobs; job++)
+    {
+        textures->block_offsets[job] = size;
+        const miptex_t* miptex = get_miptex(bsp, job / MIP_LEVELS);
+        int level = job % MIP_LEVELS;
+        if (miptex) size += compressed_size(miptex->width >> level, miptex->height >> level);
+    }
+    queue.block_offsets = textures->block_offsets;
+    for (int f = 0; f < BLOCK_FORMATS; f++) queue.blocks[f] = options->compress & (1 << f) ? malloc(size) : NULL;
+
+    run_workers(MAX(1, MIN(options->num_threads, (int)queue.num_jobs)), compress_worker, &queue);
+    pthread_mutex_destroy(&queue.lock);
+
+    for (int f = 0; f < BLOCK_FORMATS; f++)
+    {
+        if (!queue.blocks[f]) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "textures.%s", block_formats[f].name);
+        writer_t blocks_out;
+        create_output_file(&blocks_out, base, name, options);
+        writer_write(&blocks_out, queue.blocks[f], size);
+        close_output_file(&blocks_out);
+        free(queue.blocks[f]);
+    }
+}
+
+// All four mip levels the map stores for each texture, decoded to
+// RGBA and written one after the other, so a renderer can upload the
+// chain as it is rather than generate the mips itself. Textures left
+// out of the map take no space.
+//
+// With --indexed the levels stay as the map has them, a byte per texel,
+// and the palette goes to its own file as 256 RGBA colours for the
+// shader to look them up in. With --compress they're also block
+// compressed, on the converter's threads.
+static void textures_to_json(const bsp_context_t* bsp, const uint8_t palette[256 * 3], const char* base, const options_t* options, texture_file_t* textures)
+{
+    uint8_t colors[256][4];
+    for (int i = 0; i < 256; i++)
+    {
+        memcpy(colors[i], &palette[i * 3], 3);
+        colors[i][3] = 255;
+    }
+
+    if (options->indexed)
+    {
+        writer_t palette_out;
+        create_output_file(&palette_out, base, "palette.bin", options);
+        writer_write(&palette_out, colors, sizeof(colors));
+        close_output_file(&palette_out);
+    }
+
+    writer_t textures_out;
+    create_output_file(&textures_out, base, "textures.bin", options);
+    textures->num_textures = bsp->num_miptextures;
+    textures->offsets = malloc(bsp->num_miptextures * MIP_LEVELS * sizeof(uint32_t));
+
+    uint32_t offset = 0;
+    for (int i = 0; i < bsp->num_miptextures; i++)
+    {
+        const miptex_t* miptex = get_miptex(bsp, i);
+        for (int level = 0; level < MIP_LEVELS; level++)
+        {
+            textures->offsets[i * MIP_LEVELS + level] = offset;
+            if (!miptex) continue;
+
+            const uint8_t* pixels = (const uint8_t*)miptex + (&miptex->offset1)[level];
+            uint32_t count = (miptex->width >> level) * (miptex->height >> level);
+            if (options->indexed)
+            {
+                writer_write(&textures_out, pixels, count);
+                offset += count;
+                continue;
+            }
+            for (uint32_t p = 0; p < count; p += 4096)
+            {
+                uint32_t batch = MIN(count - p, 4096);
+                decode_texels(&pixels[p], batch, colors, (uint8_t*)writer_reserve(&textures_out, batch * 4));
+                writer_commit(&textures_out, batch * 4);
+            }
+            offset += count * 4;
+        }
+    }
+    close_output_file(&textures_out);
+
+    if (options->compress) compress_textures(bsp, colors, base, options, textures);
+}
+
+// Texture names are up to 16 characters, not necessarily terminated.
+static void write_texture_name(writer_t* writer, const char* name)
+{
+    writer_printf(writer, "\"");
+    for (int i = 0; i < 16 && name[i]; i++)
+    {
+        unsigned char c = name[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') writer_printf(writer, "\\u%04x", c);
+        else writer_write(writer, &name[i], 1);
+    }
+    writer_printf(writer, "\"");
+}
+
+// Describes the vertex and index files and lists the chunks and draws.
+// Indices are relative to the first vertex of their chunk, and a
+// renderer can bind each texture once per chunk and draw its range.
+static void write_manifest(const bsp_context_t* bsp, const mesh_t* mesh, const lightmap_atlas_t* lightmaps, const texture_file_t* textures, const node_tree_t* nodes, const char* base, const options_t* options)
+{
+    // File names in the manifest are relative to the manifest itself
+    const char* name = file_name_only(base);
+    const char* extension = options->binary ? "bin" : "json";
+    const char* index_type = !options->binary ? "json" : options->index32 ? "uint32" : "uint16";
+
+    writer_t manifest_out;
+    writer_t* manifest = &manifest_out;
+    create_output_file(manifest, base, "mesh.json", options);
+    writer_printf(manifest, "{\n");
+    writer_printf(manifest, "  \"vertices\" : { \"file\" : \"%s.vertices.%s\", \"count\" : %u, \"stride\" : %d,\n",
+        name, extension, mesh->num_vertices, (int)(mesh->stride * sizeof(float)));
+    writer_printf(manifest, "                \"position\" : 0, \"normal\" : 12, \"color\" : 24, \"texcoord\" : 36%s },\n",
+        options->lightmap_atlas ? ", \"lightmap_texcoord\" : 48" : "");
+    writer_printf(manifest, "  \"indices\"  : { \"file\" : \"%s.indices.%s\", \"count\" : %u, \"type\" : \"%s\" },\n",
+        name, extension, mesh->num_indices, index_type);
+    if (options->lightmap_atlas)
+    {
+        writer_printf(manifest, "  \"lightmaps\" : { \"file\" : \"%s.lightmaps.bin\", \"format\" : \"r8\", \"pages\" : [", name);
+        for (int i = 0, offset = 0; i < lightmaps->num_pages; i++)
+        {
+            const lightmap_page_t* page = &lightmaps->pages[i];
+            writer_printf(manifest, "%s\n    { \"width\" : %d, \"height\" : %d, \"offset\" : %d }",
+                i ? "," : "", page->width, page->height, offset);
+            offset += page->width * page->height;
+        }
+        writer_printf(manifest, "\n  ] },\n");
+    }
+    if (options->pvs)
+    {
+        // Leaves are 32 bit little endian words
+        writer_printf(manifest, "  \"leaves\"   : { \"file\" : \"%s.leaves.bin\", \"count\" : %d, \"stride\" : %d,\n", name, bsp->num_leaves, LEAF_WORDS * 4);
+        writer_printf(manifest, "                \"contents\" : 0, \"mins\" : 4, \"maxs\" : 16, \"first_face\" : 28, \"face_count\" : 32, \"pvs_offset\" : 36, \"pvs_size\" : 40 },\n");
+        writer_printf(manifest, "  \"leaf_faces\" : { \"file\" : \"%s.leaf_faces.bin\", \"count\" : %d, \"type\" : \"uint16\" },\n", name, bsp->num_leaf_faces);
+        writer_printf(manifest, "  \"pvs\"      : { \"file\" : \"%s.pvs.bin\", \"encoding\" : \"%s\", \"row_bytes\" : %d, \"first_leaf\" : 1 },\n",
+            name, options->pvs == PVS_RLE ? "rle" : "bits", pvs_row_bytes(bsp));
+    }
+    if (options->nodes)
+    {
+        // Children are records, or -1 - leaf. The index ranges may cross
+        // chunks, where 16 bit indices are relative to each chunk's vertices.
+        writer_printf(manifest, "  \"nodes\"    : { \"file\" : \"%s.nodes.bin\", \"count\" : %u, \"stride\" : %d,\n", name, nodes->num_records, NODE_BYTES);
+        writer_printf(manifest, "                \"mins\" : 0, \"maxs\" : 6, \"front\" : 12, \"back\" : 16, \"next\" : 20, \"first_face\" : 24, \"face_count\" : 26,\n");
+        writer_printf(manifest, "                \"first_index\" : 28, \"index_count\" : 32, \"face_index_count\" : 36 },\n");
+    }
+    if (options->textures)
+    {
+        // Indexed by the draws' texture
+        writer_printf(manifest, "  \"textures\" : { \"file\" : \"%s.textures.bin\", \"format\" : \"%s\", ", name, options->indexed ? "r8" : "rgba8");
+        if (options->indexed) writer_printf(manifest, "\"palette\" : { \"file\" : \"%s.palette.bin\", \"format\" : \"rgba8\", \"count\" : 256 },\n                 ", name);
+        if (options->compress)
+        {
+            writer_printf(manifest, "\"compressed\" : [");
+            for (int f = 0, first = 1; f < BLOCK_FORMATS; f++)
+            {
+                if (!(options->compress & (1 << f))) continue;
+                writer_printf(manifest, "%s { \"file\" : \"%s.textures.%s\", \"format\" : \"%s\" }",
+                    first ? "" : ",", name, block_formats[f].name, block_formats[f].name);
+                first = 0;
+            }
+            writer_printf(manifest, " ],\n                 ");
+        }
+        writer_printf(manifest, "\"textures\" : [");
+        for (int i = 0; i < textures->num_textures; i++)
+        {
+            const miptex_t* miptex = get_miptex(bsp, i);
+            writer_printf(manifest, "%s\n    { \"name\" : ", i ? "," : "");
+            write_texture_name(manifest, miptex ? miptex->name : "");
+            if (!miptex)
+            {
+                writer_printf(manifest, ", \"width\" : 0, \"height\" : 0, \"mips\" : []%s }", options->compress ? ", \"blocks\" : []" : "");
+                continue;
+            }
+            const uint32_t* mips = &textures->offsets[i * MIP_LEVELS];
+            writer_printf(manifest, ", \"width\" : %u, \"height\" : %u, \"mips\" : [%u, %u, %u, %u]",
+                miptex->width, miptex->height, mips[0], mips[1], mips[2], mips[3]);
+            if (options->compress)
+            {
+                const uint32_t* blocks = &textures->block_offsets[i * MIP_LEVELS];
+                writer_printf(manifest, ", \"blocks\" : [%u, %u, %u, %u]", blocks[0], blocks[1], blocks[2], blocks[3]);
+            }
+            writer_printf(manifest, " }");
+        }
+        writer_printf(manifest, "\n  ] },\n");
+    }
+    writer_printf(manifest, "  \"chunks\"   : [");
+    for (uint32_t i = 0; i < mesh->num_chunks; i++)
+    {
+        const chunk_t* chunk = &mesh->chunks[i];
+        writer_printf(manifest, "%s\n    { \"first_vertex\" : %u, \"vertex_count\" : %u, \"first_index\" : %u, \"index_count\" : %u }",
+            i ? "," : "", chunk->first_vertex, chunk->num_vertices, chunk->first_index, chunk->num_indices);
+    }
+    writer_printf(manifest, "\n  ],\n");
+    writer_printf(manifest, "  \"draws\"    : [");
+    for (uint32_t i = 0; i < mesh->num_draws; i++)
+    {
+        const draw_t* draw = &mesh->draws[i];
+        writer_printf(manifest, "%s\n    { \"model\" : %u, \"texture\" : %u, ", i ? "," : "", draw->model, draw->texture);
+        if (options->lightmap_atlas) writer_printf(manifest, "\"lightmap\" : %u, ", draw->lightmap);
+        if (options->leaf_ranges) writer_printf(manifest, "\"leaf\" : %u, ", draw->leaf);
+        if (options->nodes) writer_printf(manifest, "\"node\" : %u, ", draw->node);
+        writer_printf(manifest, "\"chunk\" : %u, \"first\" : %u, \"count\" : %u }", draw->chunk, draw->first_index, draw->num_indices);
+    }
+    writer_printf(manifest, "\n  ],\n");
+
+    // The world's draws are sorted by leaf, so each leaf's draws and
+    // their indices are a range. Together they repeat shared faces, a
+    // renderer draws the ranges of the visible leaves instead. The index
+    // range may cross chunks, where 16 bit indices are relative to each
+    // chunk's vertices, so only with JSON or --index32 is it always one
+    // draw call.
+    if (options->leaf_ranges)
+    {
+        writer_printf(manifest, "  \"leaf_draws\" : [");
+        for (uint32_t i = 0, first = 0; i < (uint32_t)bsp->num_leaves; i++)
+        {
+            uint32_t count = 0, num_indices = 0;
+            for (; first + count < mesh->num_draws; count++)
+            {
+                const draw_t* draw = &mesh->draws[first + count];
+                if (draw->model != 0 || draw->leaf != i) break;
+                num_indices += draw->num_indices;
+            }
+            uint32_t first_index = count ? mesh->draws[first].first_index : 0;
+            writer_printf(manifest, "%s\n    { \"first_draw\" : %u, \"draw_count\" : %u, \"first_index\" : %u, \"index_count\" : %u }",
+                i ? "," : "", first, count, first_index, num_indices);
+            first += count;
+        }
+        writer_printf(manifest, "\n  ],\n");
+    }
+
+    // Draws are sorted by model, so each model's draws are a range
+    writer_printf(manifest, "  \"models\"   : [");
+    for (uint32_t i = 0, first = 0; i < (uint32_t)bsp->num_models; i++)
+    {
+        uint32_t count = 0;
+        while (first + count < mesh->num_draws && mesh->draws[first + count].model == i) count++;
+        writer_printf(manifest, "%s\n    { \"model\" : \"*%u\", \"origin\" : [%g, %g, %g], \"first_draw\" : %u, \"draw_count\" : %u",
+            i ? "," : "", i, bsp->models[i].origin.x, bsp->models[i].origin.y, bsp->models[i].origin.z, first, count);
+        if (options->nodes) writer_printf(manifest, ", \"node\" : %u", nodes->model_roots[i]);
+        writer_printf(manifest, " }");
+        first += count;
+    }
+    writer_printf(manifest, "\n  ]\n");
+    writer_printf(manifest, "}\n");
+    close_output_file(manifest);
+}
+
+static void to_json(vfs_t* vfs, const char* file, const options_t* options)
+{
+    // Lumps are visited in no particular order, but nearly all of
+    // the file is touched, so ask for it to be paged in up front.
+    vfs_file_t input;
+    if (!vfs_open(vfs, file, &input, MADV_WILLNEED)) fatal("Unable to find %s", file);
+    const char* data = input.data;
+
+    // Maps read out of a pak are written to the current directory,
+    // named after the entry: 'pak0.pak:maps/e1m1.bsp' => 'e1m1.bsp.*.json'
+    const char* base = file;
+    if (input.pak) base = file_name_only(input.entry_name);
+
+    bsp_context_t bsp;
+    init_bsp_context(&bsp, file, data, input.size);
+
+    const dheader_t* header = (const dheader_t*)data;
+    printf("Reading %s BSP version %d\n", file, header->version);
+
+    validate_bsp(&bsp, file);
+
+    // Before anything slow, in case it's missing
+    uint8_t palette[256 * 3];
+    if (options->textures) load_palette(vfs, palette);
+
+    for (int i=0; i<bsp.num_miptextures; i++)
+    {
+        const miptex_t* miptex = get_miptex(&bsp, i);
+        if (!miptex) continue;
+        char name_data[17] = {};
+        strncpy(name_data, miptex->name, 16);
+        printf("Texture: %s\n", name_data);
+    }
+    
+    writer_t entities_out;
+    create_output_file(&entities_out, base, "entities.json", options);
+    writer_write(&entities_out, bsp.entities, bsp.num_entities);
+    close_output_file(&entities_out);
+
+    traversal_t traversal;
+    traversal.faces = NULL;
+    traversal.num_faces = 0;
+    traversal.max_faces = 0;
+    traversal.stack = NULL;
+    traversal.max_stack = 0;
+
+    nodes_to_json(&bsp, &traversal);
+
+    mesh_t mesh;
+    init_mesh(&mesh, options->lightmap_atlas ? LIGHTMAP_VERTEX_FLOATS : VERTEX_FLOATS);
+    lightmap_atlas_t lightmaps = { NULL, 0 };
+    faces_to_mesh(&bsp, &traversal, &mesh, &lightmaps, options);
+    if (options->leaf_ranges) order_by_leaf(&bsp, &traversal, &mesh);
+    node_tree_t nodes = { NULL, 0, 0, NULL, NULL };
+    if (options->nodes)
+    {
+        flatten_nodes(&bsp, &nodes);
+        tag_node_draws(&nodes, &traversal, &mesh);
+    }
+    free(traversal.faces);
+    free(traversal.stack);
+
+    batch_draws(&mesh);
+
+    // JSON has no 16 bit limit, its indices stay one buffer as the client loads them
+    chunk_mesh(&mesh, options->index32 || !options->binary ? UINT32_MAX : 0x10000);
+
+    if (options->binary) write_binary_mesh(&mesh, base, options);
+    else write_json_mesh(&mesh, base, options);
+    if (options->lightmap_atlas) write_lightmaps(&lightmaps, base, options);
+
+    texture_file_t textures = { 0, NULL, NULL };
+    if (options->textures) textures_to_json(&bsp, palette, base, options, &textures);
+    if (options->pvs) leaves_to_json(&bsp, base, options);
+    if (options->nodes) write_nodes(&nodes, &mesh, base, options);
+    write_manifest(&bsp, &mesh, &lightmaps, &textures, &nodes, base, options);
+
+    free_mesh(&mesh);
+    free_lightmap_atlas(&lightmaps);
+    free_node_tree(&nodes);
+    free(textures.offsets);
+    free(textures.block_offsets);
+
+    vfs_close_file(&input);
+}
+
+static void usage(const char* program)
+{
+    fatal("Usage: %s [--pak <filename.pak>]... [--binary] [--weld] [--index32] [--lightmaps] [--textures] [--indexed] [--compress dxt1,etc1] [--quality fast|normal|best] [--pvs bits|rle] [--leaf-ranges] [--nodes] [--stdout] [-j threads] [--kernels scalar|sse|avx2] <filename.bsp | filename.pak:maps/name.bsp>...\n", program);
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option long_options[] =
+    {
+        { "pak",         required_argument, NULL, 'p' },
+        { "binary",      no_argument,       NULL, 'b' },
+        { "weld",        no_argument,       NULL, 'w' },
+        { "index32",     no_argument,       NULL, 'i' },
+        { "lightmaps",   no_argument,       NULL, 'l' },
+        { "textures",    no_argument,       NULL, 't' },
+        { "indexed",     no_argument,       NULL, 'x' },
+        { "compress",    required_argument, NULL, 'z' },
+        { "quality",     required_argument, NULL, 'q' },
+        { "pvs",         required_argument, NULL, 'v' },
+        { "leaf-ranges", no_argument,       NULL, 'r' },
+        { "nodes",       no_argument,       NULL, 'n' },
+        { "stdout",      no_argument,       NULL, 'c' },
+        { "jobs",        required_argument, NULL, 'j' },
+        { "kernels",     required_argument, NULL, 'k' },
+        { NULL,          0,                 NULL, 0   }
+    };
+
+    vfs_t vfs;
+    vfs_init(&vfs);
+
+    options_t options;
+    memset(&options, 0, sizeof(options));
+    options.output_fd = -1;
+    options.num_threads = 1;
+    options.quality = QUALITY_NORMAL;
+
+    for (int option; (option = getopt_long(argc, argv, "p:bwiltxz:q:v:rncj:k:", long_options, NULL)) != -1; )
+    {
+        switch (option)
+        {
+            case 'p': vfs_add_pak(&vfs, optarg); break;
+            case 'b': options.binary = 1; break;
+            case 'w': options.weld = 1; break;
+            case 'i': options.index32 = 1; break;
+            case 'l': options.lightmap_atlas = 1; break;
+            case 't': options.textures = 1; break;
+            case 'x': options.textures = options.indexed = 1; break;
+            case 'z': options.textures = 1; options.compress = parse_block_formats(optarg); break;
+            case 'q': options.quality = parse_quality(optarg); break;
+            case 'r': options.leaf_ranges = 1; break;
+            case 'n': options.nodes = 1; break;
+            case 'v':
+                if (!strcmp(optarg, "bits")) options.pvs = PVS_BITS;
+                else if (!strcmp(optarg, "rle")) options.pvs = PVS_RLE;
+                else usage(argv[0]);
+                break;
+            case 'c': options.output_fd = STDOUT_FILENO; break;
+            case 'j': options.num_threads = atoi(optarg); break;
+            case 'k': options.kernels = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || options.num_threads < 1) usage(argv[0]);
+    if (options.leaf_ranges && options.nodes) fatal("--leaf-ranges and --nodes order the triangles differently, pick one");
+    init_kernels(options.kernels);
+
+    // Keep the real stdout for the output files, framed so a reader can
+    // split them apart again (see writer.c), and send everything that
+    // would have been printed to it to stderr instead.
+    if (options.output_fd >= 0)
+    {
+        options.output_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    for (int i=optind; i<argc; i++) to_json(&vfs, argv[i], &options);
+
+    vfs_close(&vfs);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,413 @@
+// Which leaf of a BSP tree points are in, and so their contents.
+//
+// The nodes are copied into one small record each, and points go down
+// the tree a batch at a time, one per SIMD lane. Every step gathers the
+// plane of each lane's node, tests all the points against them at once
+// and picks the children with a blend rather than a branch. A lane that
+// reaches a leaf hands its point back, and once half of them have the
+// lanes are refilled from the batch, so a few deep paths don't hold up
+// the rest. The batches use the scalar descent unless told otherwise,
+// see use_kernel().
+//
+//   LeafQuery query(data, size);
+//   int leaf = query.leaf(point);
+//   query.contents(points, count, contents);
+//
+// As in Quake, a point goes to the front child only when it is strictly
+// in front of the plane. The batched versions give the same leaves as
+// leaf(), the plane tests being the same float operations in the same
+// order.
+
+#ifndef LEAF_QUERY_H
+#define LEAF_QUERY_H
+
+#include <vector>
+#include "bsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEAF_QUERY_X86 1
+#endif
+
+// The contents of a leaf, dleaf_t::type
+enum
+{
+    CONTENTS_EMPTY = -1,
+    CONTENTS_SOLID = -2,
+    CONTENTS_WATER = -3,
+    CONTENTS_SLIME = -4,
+    CONTENTS_LAVA  = -5,
+    CONTENTS_SKY   = -6,
+};
+
+typedef struct
+{
+    float   plane[4];           // normal, then distance
+    int32_t children[2];        // front and back: a node, or -1 - leaf
+    int32_t unused[2];          // to keep a node within a cache line
+} query_node_t;
+
+class LeafQuery
+{
+private:
+    typedef void (*descend_t)(const query_node_t* nodes, int num_nodes, int32_t root,
+                              const float* x, const float* y, const float* z, int count, int32_t* leaves);
+
+    static const int BATCH = 256;
+
+    std::vector<query_node_t> m_nodes;
+    std::vector<int32_t>      m_roots;      // node of each model
+    std::vector<int32_t>      m_contents;   // of each leaf
+    const char*               m_kernel;
+    descend_t                 m_descend;
+
+    template <typename Type> static const Type* lump(const char* data, size_t size, const dentry_t& entry, const char* name, int* count)
+    {
+        if (entry.offset < 0 || entry.size < 0 || (size_t)entry.offset + entry.size > size) fatal("The %s lump is outside the file", name);
+        *count = entry.size / sizeof(Type);
+        return (const Type*)(data + entry.offset);
+    }
+
+    static void cycle(int32_t root)
+    {
+        fatal("The tree under node %d has a cycle in it", root);
+    }
+
+    static int32_t descend_point(const query_node_t* nodes, int num_nodes, int32_t root, float x, float y, float z)
+    {
+        // A path through a tree visits each node at most once
+        int32_t node = root;
+        for (int steps = 0; node >= 0; steps++)
+        {
+            if (steps == num_nodes) cycle(root);
+            const float* plane = nodes[node].plane;
+            float sum = 0;
+            sum += x * plane[0];
+            sum += y * plane[1];
+            sum += z * plane[2];
+            node = nodes[node].children[!(sum - plane[3] > 0)];
+        }
+        return -1 - node;
+    }
+
+    static void descend_scalar(const query_node_t* nodes, int num_nodes, int32_t root,
+                               const float* x, const float* y, const float* z, int count, int32_t* leaves)
+    {
+        for (int i = 0; i < count; i++) leaves[i] = descend_point(nodes, num_nodes, root, x[i], y[i], z[i]);
+    }
+
+#ifdef LEAF_QUERY_X86
+
+    // The lanes of a batched descent. Each follows one point down the
+    // tree, and as soon as it reaches a leaf takes the next point of the
+    // batch, so no lane waits on another's deeper path.
+    struct lanes_t
+    {
+        float   x[8];
+        float   y[8];
+        float   z[8];
+        int32_t node[8];            // a leaf once the lane is done
+        int32_t steps[8];           // taken by the lane's point so far
+        int     point[8];           // the lane's point, or -1
+        int     active;             // a bit per lane with a point to finish
+        int     next;               // the next point to hand out
+    };
+
+    // Write out the leaves of the 'finished' lanes and give them the next
+    // points, or retire them when there are none left.
+    static void refill(lanes_t& lanes, int finished, int32_t root,
+                       const float* x, const float* y, const float* z, int count, int32_t* leaves)
+    {
+        for (; finished; finished &= finished - 1)
+        {
+            int k = __builtin_ctz(finished);
+            if (lanes.point[k] >= 0) leaves[lanes.point[k]] = -1 - lanes.node[k];
+
+            // A retired lane keeps its leaf, so it stays done
+            if (lanes.next == count)
+            {
+                lanes.active &= ~(1 << k);
+                continue;
+            }
+            int i = lanes.next++;
+            lanes.x[k] = x[i];
+            lanes.y[k] = y[i];
+            lanes.z[k] = z[i];
+            lanes.node[k] = root;
+            lanes.steps[k] = 0;
+            lanes.point[k] = i;
+        }
+    }
+
+    static void start_lanes(lanes_t& lanes, int width, int32_t root,
+                            const float* x, const float* y, const float* z, int count, int32_t* leaves)
+    {
+        memset(&lanes, 0, sizeof(lanes));
+        for (int k = 0; k < width; k++)
+        {
+            lanes.node[k] = -1;
+            lanes.point[k] = -1;
+        }
+        lanes.active = (1 << width) - 1;
+        refill(lanes, lanes.active, root, x, y, z, count, leaves);
+    }
+
+    // SSE2 has no gathers, the lanes' planes and children are loaded
+    // one at a time, but the descents still overlap their cache misses.
+    static void descend_sse(const query_node_t* nodes, int num_nodes, int32_t root,
+                            const float* x, const float* y, const float* z, int count, int32_t* leaves)
+    {
+        const __m128i one = _mm_set1_epi32(1);
+        const __m128i last_step = _mm_set1_epi32(num_nodes);
+        lanes_t lanes;
+        start_lanes(lanes, 4, root, x, y, z, count, leaves);
+
+        while (lanes.active)
+        {
+            __m128 px = _mm_loadu_ps(lanes.x);
+            __m128 py = _mm_loadu_ps(lanes.y);
+            __m128 pz = _mm_loadu_ps(lanes.z);
+            __m128i node = _mm_loadu_si128((const __m128i*)lanes.node);
+            __m128i steps = _mm_loadu_si128((const __m128i*)lanes.steps);
+
+            for (;;)
+            {
+                __m128i done = _mm_cmplt_epi32(node, _mm_setzero_si128());
+                int finished = _mm_movemask_ps(_mm_castsi128_ps(done)) & lanes.active;
+                if (finished && (__builtin_popcount(finished) >= 2 || finished == lanes.active))
+                {
+                    _mm_storeu_si128((__m128i*)lanes.node, node);
+                    _mm_storeu_si128((__m128i*)lanes.steps, steps);
+                    refill(lanes, finished, root, x, y, z, count, leaves);
+                    break;
+                }
+                if (_mm_movemask_epi8(_mm_andnot_si128(done, _mm_cmpeq_epi32(steps, last_step)))) cycle(root);
+
+                // Retired lanes look at node 0, and then keep their leaf
+                int32_t index[4];
+                _mm_storeu_si128((__m128i*)index, _mm_andnot_si128(done, node));
+                const query_node_t* n[4] = { &nodes[index[0]], &nodes[index[1]], &nodes[index[2]], &nodes[index[3]] };
+                __m128 a = _mm_loadu_ps(n[0]->plane);
+                __m128 b = _mm_loadu_ps(n[1]->plane);
+                __m128 c = _mm_loadu_ps(n[2]->plane);
+                __m128 d = _mm_loadu_ps(n[3]->plane);
+                _MM_TRANSPOSE4_PS(a, b, c, d);
+
+                __m128 sum = _mm_add_ps(_mm_setzero_ps(), _mm_mul_ps(px, a));
+                sum = _mm_add_ps(sum, _mm_mul_ps(py, b));
+                sum = _mm_add_ps(sum, _mm_mul_ps(pz, c));
+                __m128i front = _mm_castps_si128(_mm_cmpgt_ps(_mm_sub_ps(sum, d), _mm_setzero_ps()));
+
+                int32_t back[4];
+                _mm_storeu_si128((__m128i*)back, _mm_andnot_si128(front, one));
+                __m128i next = _mm_setr_epi32(n[0]->children[back[0]], n[1]->children[back[1]],
+                                              n[2]->children[back[2]], n[3]->children[back[3]]);
+                node = _mm_or_si128(_mm_and_si128(done, node), _mm_andnot_si128(done, next));
+                steps = _mm_add_epi32(steps, _mm_andnot_si128(done, one));
+            }
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void descend_avx2(const query_node_t* nodes, int num_nodes, int32_t root,
+                             const float* x, const float* y, const float* z, int count, int32_t* leaves)
+    {
+        // Nodes are 8 words, gathered from with the node index times 8
+        const float* planes = nodes[0].plane;
+        const int* children = (const int*)nodes[0].children;
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i last_step = _mm256_set1_epi32(num_nodes);
+        lanes_t lanes;
+        start_lanes(lanes, 8, root, x, y, z, count, leaves);
+
+        while (lanes.active)
+        {
+            __m256 px = _mm256_loadu_ps(lanes.x);
+            __m256 py = _mm256_loadu_ps(lanes.y);
+            __m256 pz = _mm256_loadu_ps(lanes.z);
+            __m256i node = _mm256_loadu_si256((const __m256i*)lanes.node);
+            __m256i steps = _mm256_loadu_si256((const __m256i*)lanes.steps);
+
+            for (;;)
+            {
+                __m256i done = _mm256_cmpgt_epi32(_mm256_setzero_si256(), node);
+                int finished = _mm256_movemask_ps(_mm256_castsi256_ps(done)) & lanes.active;
+                if (finished && (__builtin_popcount(finished) >= 4 || finished == lanes.active))
+                {
+                    _mm256_storeu_si256((__m256i*)lanes.node, node);
+                    _mm256_storeu_si256((__m256i*)lanes.steps, steps);
+                    refill(lanes, finished, root, x, y, z, count, leaves);
+                    break;
+                }
+                if (_mm256_movemask_epi8(_mm256_andnot_si256(done, _mm256_cmpeq_epi32(steps, last_step)))) cycle(root);
+
+                __m256i index = _mm256_slli_epi32(_mm256_andnot_si256(done, node), 3);
+                __m256 a = _mm256_i32gather_ps(planes, index, 4);
+                __m256 b = _mm256_i32gather_ps(planes + 1, index, 4);
+                __m256 c = _mm256_i32gather_ps(planes + 2, index, 4);
+                __m256 d = _mm256_i32gather_ps(planes + 3, index, 4);
+
+                __m256 sum = _mm256_add_ps(_mm256_setzero_ps(), _mm256_mul_ps(px, a));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(py, b));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(pz, c));
+                __m256i front = _mm256_castps_si256(_mm256_cmp_ps(_mm256_sub_ps(sum, d), _mm256_setzero_ps(), _CMP_GT_OQ));
+
+                __m256i next = _mm256_i32gather_epi32(children, _mm256_add_epi32(index, _mm256_andnot_si256(front, one)), 4);
+                node = _mm256_blendv_epi8(next, node, done);
+                steps = _mm256_add_epi32(steps, _mm256_andnot_si256(done, one));
+            }
+        }
+    }
+
+#endif
+
+    int32_t root(int model) const
+    {
+        if (model < 0 || model >= (int)m_roots.size()) fatal("Model %d out of %d", model, (int)m_roots.size());
+        return m_roots[model];
+    }
+
+public:
+
+    // 'data' is a whole BSP file, which needn't outlive the query.
+    LeafQuery(const char* data, size_t size)
+    {
+        if (size < sizeof(dheader_t)) fatal("A BSP file is at least %d bytes", (int)sizeof(dheader_t));
+        const dheader_t* header = (const dheader_t*)data;
+
+        int num_planes, num_nodes, num_leaves, num_models;
+        const plane_t* planes = lump<plane_t>(data, size, header->planes, "planes", &num_planes);
+        const node_t* nodes = lump<node_t>(data, size, header->nodes, "nodes", &num_nodes);
+        const dleaf_t* leaves = lump<dleaf_t>(data, size, header->leaves, "leaves", &num_leaves);
+        const model_t* models = lump<model_t>(data, size, header->models, "models", &num_models);
+
+        m_nodes.resize(num_nodes);
+        for (int i = 0; i < num_nodes; i++)
+        {
+            const node_t* node = &nodes[i];
+            query_node_t* out = &m_nodes[i];
+            if (node->plane_id < 0 || node->plane_id >= num_planes) fatal("Node %d: plane %d out of %d", i, node->plane_id, num_planes);
+            const plane_t* plane = &planes[node->plane_id];
+            out->plane[0] = plane->normal.x;
+            out->plane[1] = plane->normal.y;
+            out->plane[2] = plane->normal.z;
+            out->plane[3] = plane->dist;
+
+            uint16_t children[2] = { node->front, node->back };
+            for (int k = 0; k < 2; k++)
+            {
+                int leaf = (uint16_t)~children[k];
+                if (children[k] & 0x8000)
+                {
+                    if (leaf >= num_leaves) fatal("Node %d: leaf %d out of %d", i, leaf, num_leaves);
+                    out->children[k] = -1 - leaf;
+                }
+                // Node 0 is a root, as a child there's nothing there, as in solid leaf 0
+                else if (children[k] == 0) out->children[k] = -1;
+                else if (children[k] >= num_nodes) fatal("Node %d: child node %d out of %d", i, children[k], num_nodes);
+                else out->children[k] = children[k];
+            }
+            out->unused[0] = out->unused[1] = 0;
+        }
+
+        m_roots.resize(num_models);
+        for (int i = 0; i < num_models; i++)
+        {
+            if (models[i].node_id0 < 0 || models[i].node_id0 >= num_nodes) fatal("Model %d: node %d out of %d", i, models[i].node_id0, num_nodes);
+            m_roots[i] = models[i].node_id0;
+        }
+
+        m_contents.resize(num_leaves);
+        for (int i = 0; i < num_leaves; i++) m_contents[i] = leaves[i].type;
+
+        use_kernel(NULL);
+    }
+
+    // Whether use_kernel() can take 'name' on this CPU.
+    static bool has_kernel(const char* name)
+    {
+        if (!strcmp(name, "scalar")) return true;
+#ifdef LEAF_QUERY_X86
+        __builtin_cpu_init();
+        if (!strcmp(name, "sse")) return __builtin_cpu_supports("sse2");
+        if (!strcmp(name, "avx2")) return __builtin_cpu_supports("avx2");
+#endif
+        return false;
+    }
+
+    // 'name' is "scalar", "sse" or "avx2", or NULL for scalar. The SIMD
+    // versions only pay off on trees balanced enough for the lanes to
+    // finish together, and on CPUs with fast gathers: on a small or
+    // lopsided tree they can be slower, so time them (leafbench) first.
+    void use_kernel(const char* name)
+    {
+        if (!name) name = "scalar";
+        if (!has_kernel(name)) fatal("Kernel '%s' isn't available", name);
+
+        m_kernel = "scalar";
+        m_descend = descend_scalar;
+#ifdef LEAF_QUERY_X86
+        if (!strcmp(name, "sse"))
+        {
+            m_kernel = "sse";
+            m_descend = descend_sse;
+        }
+        else if (!strcmp(name, "avx2"))
+        {
+            m_kernel = "avx2";
+            m_descend = descend_avx2;
+        }
+#endif
+    }
+
+    const char* kernel(void) const
+    {
+        return m_kernel;
+    }
+
+    int num_models(void) const
+    {
+        return (int)m_roots.size();
+    }
+
+    int num_leaves(void) const
+    {
+        return (int)m_contents.size();
+    }
+
+    // Points are relative to the model's origin.
+    int leaf(const vertex_t& point, int model = 0) const
+    {
+        return descend_point(m_nodes.data(), (int)m_nodes.size(), root(model), point.x, point.y, point.z);
+    }
+
+    int contents(const vertex_t& point, int model = 0) const
+    {
+        return m_contents[leaf(point, model)];
+    }
+
+    void leaves(const vertex_t* points, int count, int32_t* leaves, int model = 0) const
+    {
+        int32_t start = root(model);
+        float x[BATCH], y[BATCH], z[BATCH];
+        for (int first = 0; first < count; first += BATCH)
+        {
+            int batch = MIN(BATCH, count - first);
+            for (int i = 0; i < batch; i++)
+            {
+                x[i] = points[first + i].x;
+                y[i] = points[first + i].y;
+                z[i] = points[first + i].z;
+            }
+            m_descend(m_nodes.data(), (int)m_nodes.size(), start, x, y, z, batch, &leaves[first]);
+        }
+    }
+
+    void contents(const vertex_t* points, int count, int32_t* contents, int model = 0) const
+    {
+        leaves(points, count, contents, model);
+        for (int i = 0; i < count; i++) contents[i] = m_contents[contents[i]];
+    }
+};
+
+#endif
@@ -0,0 +1,142 @@
+// Times LeafQuery on random points inside a map's world model, point by
+// point and in batches with each kernel, and checks they all agree.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+#include "../../utils.c"
+#include "../../pak.c"
+#include "../../vfs.c"
+
+#include "bsp.h"
+#include "leaf_query.h"
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Repeats 'query' over all the points for at least a fraction of a
+// second, returns queries per second.
+template <typename Query> static double time_queries(int count, Query query)
+{
+    int rounds = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        query();
+        rounds++;
+        elapsed = now() - start;
+    } while (elapsed < 0.5);
+    return (double)count * rounds / elapsed;
+}
+
+static void check_leaves(const char* name, const std::vector<int32_t>& leaves, const std::vector<int32_t>& expected)
+{
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+        if (leaves[i] != expected[i]) fatal("%s: point %d is in leaf %d, not %d", name, (int)i, leaves[i], expected[i]);
+    }
+}
+
+static void bench(vfs_t* vfs, const char* file, int count)
+{
+    vfs_file_t bsp;
+    if (!vfs_open(vfs, file, &bsp, MADV_WILLNEED)) fatal("Unable to find %s", file);
+    LeafQuery query(bsp.data, bsp.size);
+
+    // Uniform in the world's bounds, the same every run
+    const dheader_t* header = (const dheader_t*)bsp.data;
+    if (header->models.size < (int)sizeof(model_t)) fatal("%s has no world model", file);
+    const boundbox_t* bound = &((const model_t*)(bsp.data + header->models.offset))->bound;
+    std::vector<vertex_t> points(count);
+    uint32_t seed = 1;
+    for (int i = 0; i < count; i++)
+    {
+        float r[3];
+        for (int k = 0; k < 3; k++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            r[k] = (seed >> 8) / (float)(1 << 24);
+        }
+        points[i].x = bound->min.x + r[0] * (bound->max.x - bound->min.x);
+        points[i].y = bound->min.y + r[1] * (bound->max.y - bound->min.y);
+        points[i].z = bound->min.z + r[2] * (bound->max.z - bound->min.z);
+    }
+
+    printf("%s: %d points, %d leaves\n", file, count, query.num_leaves());
+
+    std::vector<int32_t> expected(count);
+    double rate = time_queries(count, [&]() {
+        for (int i = 0; i < count; i++) expected[i] = query.leaf(points[i]);
+    });
+    printf("  %-8s %8.2f M queries/s\n", "point", rate * 1e-6);
+
+    // Every one this CPU has, which is faster depends on the map
+    static const char* const kernels[] = { "scalar", "sse", "avx2" };
+    std::vector<int32_t> leaves(count);
+    for (const char* kernel : kernels)
+    {
+        if (!LeafQuery::has_kernel(kernel)) continue;
+        query.use_kernel(kernel);
+
+        std::fill(leaves.begin(), leaves.end(), -1);
+        rate = time_queries(count, [&]() {
+            query.leaves(points.data(), count, leaves.data());
+        });
+        check_leaves(kernel, leaves, expected);
+        printf("  %-8s %8.2f M queries/s\n", kernel, rate * 1e-6);
+    }
+
+    // How the points fell, as a sanity check on the bounds
+    query.use_kernel(NULL);
+    query.contents(points.data(), count, leaves.data());
+    static const char* const names[] = { "empty", "solid", "water", "slime", "lava", "sky" };
+    int found[6] = {};
+    for (int i = 0; i < count; i++)
+    {
+        if (leaves[i] <= CONTENTS_EMPTY && leaves[i] >= CONTENTS_SKY) found[CONTENTS_EMPTY - leaves[i]]++;
+    }
+    printf("  contents:");
+    for (int i = 0; i < 6; i++) printf(" %s %.1f%%", names[i], 100.0 * found[i] / count);
+    printf("\n");
+
+    vfs_close_file(&bsp);
+}
+
+int main(int argc, char** argv)
+{
+    vfs_t vfs;
+    vfs_init(&vfs);
+    int count = 1 << 20;
+
+    for (int option; (option = getopt(argc, argv, "p:n:")) != -1; )
+    {
+        if (option == 'p') vfs_add_pak(&vfs, optarg);
+        else if (option == 'n') count = atoi(optarg);
+        else fatal("Usage: %s [-p <filename.pak>]... [-n points] <filename.bsp | filename.pak:maps/name.bsp>...\n", argv[0]);
+    }
+    if (optind >= argc || count < 1) fatal("Usage: %s [-p <filename.pak>]... [-n points] <filename.bsp | filename.pak:maps/name.bsp>...\n", argv[0]);
+
+    for (int i=optind; i<argc; i++) bench(&vfs, argv[i], count);
+
+    vfs_close(&vfs);
+    return EXIT_SUCCESS;
+}
@@ -1,4 +1,4 @@
-make bsp2json && ./bsp2json output/maps/$1.bsp && \
-cp output/maps/*.vertices.json public && \
-cp output/maps/*.indices.json  public && \
-python entities2json.py output/maps/$1.bsp.entities.json > public/$1.bsp.entities.json
+make bsp2json-c && ./bsp2json-c ${PAK:-pak0.pak}:maps/$1.bsp && \
+cp $1.bsp.vertices.json public && \
+cp $1.bsp.indices.json  public && \
+python entities2json.py $1.bsp.entities.json > public/$1.bsp.entities.json
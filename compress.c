@@ -0,0 +1,553 @@
+// Block compression of RGBA textures for the GPU.
+//
+// A texture is cut into 4x4 blocks, each encoded to 8 bytes as DXT1
+// (WEBGL_compressed_texture_s3tc) or ETC1 (WEBGL_compressed_texture_etc1),
+// an eighth of its size as RGBA. Neither keeps alpha, which Quake's
+// textures don't have. Blocks hanging over the edge of a texture under
+// 4 texels across repeat its last row and column.
+//
+// The quality trades time for error:
+//
+//   fast     DXT1 endpoints from the colour bounding box, ETC1
+//            modifiers picked by brightness alone
+//   normal   DXT1 endpoints along the principal axis of the colours,
+//            ETC1 trying both base colour modes against the real error
+//   best     also refits DXT1 endpoints to their indices by least
+//            squares, and tries ETC1 base colours around the mean
+//
+// Pixels are held as structure of arrays floats, so projecting them
+// onto a line goes through the SIMD kernels.
+//
+//   uint8_t* blocks = malloc(compressed_size(width, height));
+//   compress_image(&block_formats[0], QUALITY_NORMAL, rgba, width, height, blocks);
+
+#define BLOCK_BYTES   8
+#define BLOCK_FORMATS 2
+
+#define QUALITY_FAST   0
+#define QUALITY_NORMAL 1
+#define QUALITY_BEST   2
+
+typedef struct
+{
+    float r[16];                // row by row
+    float g[16];
+    float b[16];
+} block_pixels_t;
+
+typedef struct
+{
+    const char* name;
+    void (*compress)(const block_pixels_t* pixels, int quality, uint8_t out[BLOCK_BYTES]);
+} block_format_t;
+
+static float dot3(const float a[3], const float b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static float pixel_error(const block_pixels_t* pixels, int i, const float color[3])
+{
+    float r = pixels->r[i] - color[0];
+    float g = pixels->g[i] - color[1];
+    float b = pixels->b[i] - color[2];
+    return r * r + g * g + b * b;
+}
+
+static uint16_t pack_565(const float color[3])
+{
+    int r = (int)(MIN(MAX(color[0], 0), 255) * 31 / 255 + 0.5f);
+    int g = (int)(MIN(MAX(color[1], 0), 255) * 63 / 255 + 0.5f);
+    int b = (int)(MIN(MAX(color[2], 0), 255) * 31 / 255 + 0.5f);
+    return r << 11 | g << 5 | b;
+}
+
+static void unpack_565(uint16_t packed, float color[3])
+{
+    int r = packed >> 11 & 31;
+    int g = packed >> 5 & 63;
+    int b = packed & 31;
+    color[0] = r << 3 | r >> 2;
+    color[1] = g << 2 | g >> 4;
+    color[2] = b << 3 | b >> 2;
+}
+
+// The colours of a four colour block (c0 > c1), in index order.
+static void dxt1_palette(uint16_t c0, uint16_t c1, float palette[4][3])
+{
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (int k = 0; k < 3; k++)
+    {
+        palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+        palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+    }
+}
+
+// Two colours spanning the block, the first the brighter end.
+static void dxt1_endpoints(const block_pixels_t* pixels, int quality, float ends[2][3])
+{
+    float mins[3], maxs[3];
+    kernels.range(pixels->r, 16, &mins[0], &maxs[0]);
+    kernels.range(pixels->g, 16, &mins[1], &maxs[1]);
+    kernels.range(pixels->b, 16, &mins[2], &maxs[2]);
+
+    if (quality == QUALITY_FAST)
+    {
+        // Pulled in a little, the corners are rarely actual pixels
+        for (int k = 0; k < 3; k++)
+        {
+            float inset = (maxs[k] - mins[k]) / 16;
+            ends[0][k] = maxs[k] - inset;
+            ends[1][k] = mins[k] + inset;
+        }
+        return;
+    }
+
+    float mean[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++)
+    {
+        mean[0] += pixels->r[i];
+        mean[1] += pixels->g[i];
+        mean[2] += pixels->b[i];
+    }
+    for (int k = 0; k < 3; k++) mean[k] /= 16;
+
+    float covariance[6] = { 0, 0, 0, 0, 0, 0 };
+    for (int i = 0; i < 16; i++)
+    {
+        float r = pixels->r[i] - mean[0];
+        float g = pixels->g[i] - mean[1];
+        float b = pixels->b[i] - mean[2];
+        covariance[0] += r * r;
+        covariance[1] += r * g;
+        covariance[2] += r * b;
+        covariance[3] += g * g;
+        covariance[4] += g * b;
+        covariance[5] += b * b;
+    }
+
+    // Power iteration from the bounding box diagonal
+    float axis[3] = { maxs[0] - mins[0], maxs[1] - mins[1], maxs[2] - mins[2] };
+    for (int iteration = 0; iteration < 8; iteration++)
+    {
+        float next[3] =
+        {
+            covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+            covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+            covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2],
+        };
+        float length = sqrtf(dot3(next, next));
+        if (length < 1e-6f) break;
+        for (int k = 0; k < 3; k++) axis[k] = next[k] / length;
+    }
+    float length = sqrtf(dot3(axis, axis));
+    if (length < 1e-6f)
+    {
+        // A flat block
+        for (int k = 0; k < 3; k++) ends[0][k] = ends[1][k] = mean[k];
+        return;
+    }
+    for (int k = 0; k < 3; k++) axis[k] /= length;
+
+    // The extremes of the pixels along the axis
+    float projection[4] = { axis[0], axis[1], axis[2], -dot3(mean, axis) };
+    float t[16], low, high;
+    kernels.project(pixels->r, pixels->g, pixels->b, 16, projection, t);
+    kernels.range(t, 16, &low, &high);
+    for (int k = 0; k < 3; k++)
+    {
+        ends[0][k] = mean[k] + axis[k] * high;
+        ends[1][k] = mean[k] + axis[k] * low;
+    }
+}
+
+// Indices from where each pixel falls on the line between the first
+// two colours of the palette.
+static void dxt1_project_indices(const block_pixels_t* pixels, const float palette[4][3], uint8_t indices[16])
+{
+    static const uint8_t order[4] = { 0, 2, 3, 1 };
+
+    float direction[3] = { palette[1][0] - palette[0][0], palette[1][1] - palette[0][1], palette[1][2] - palette[0][2] };
+    float length = dot3(direction, direction);
+    float axis[4] = { direction[0] / length, direction[1] / length, direction[2] / length, -dot3(palette[0], direction) / length };
+
+    float t[16];
+    kernels.project(pixels->r, pixels->g, pixels->b, 16, axis, t);
+    for (int i = 0; i < 16; i++) indices[i] = order[(int)(MIN(MAX(t[i], 0), 1) * 3 + 0.5f)];
+}
+
+// The nearest palette colour for each pixel, returns the total error.
+static float dxt1_nearest_indices(const block_pixels_t* pixels, const float palette[4][3], uint8_t indices[16])
+{
+    float total = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        float best = pixel_error(pixels, i, palette[0]);
+        indices[i] = 0;
+        for (int c = 1; c < 4; c++)
+        {
+            float error = pixel_error(pixels, i, palette[c]);
+            if (error < best)
+            {
+                best = error;
+                indices[i] = c;
+            }
+        }
+        total += best;
+    }
+    return total;
+}
+
+// Put c0 first, as a four colour block needs.
+static int dxt1_order(uint16_t* c0, uint16_t* c1)
+{
+    if (*c0 == *c1) return 0;
+    if (*c0 < *c1)
+    {
+        uint16_t swap = *c0;
+        *c0 = *c1;
+        *c1 = swap;
+    }
+    return 1;
+}
+
+// Alternate between least squares endpoints for the indices and the
+// nearest indices for the endpoints, while the error goes down.
+static void dxt1_refine(const block_pixels_t* pixels, uint16_t* c0, uint16_t* c1, uint8_t indices[16])
+{
+    // How much of c0 each index is
+    static const float weights[4] = { 1, 0, 2.0f / 3, 1.0f / 3 };
+
+    float palette[4][3];
+    dxt1_palette(*c0, *c1, palette);
+    float best = dxt1_nearest_indices(pixels, palette, indices);
+
+    for (int iteration = 0; iteration < 4; iteration++)
+    {
+        float aa = 0, ab = 0, bb = 0;
+        float ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+        for (int i = 0; i < 16; i++)
+        {
+            float a = weights[indices[i]];
+            float b = 1 - a;
+            float pixel[3] = { pixels->r[i], pixels->g[i], pixels->b[i] };
+            aa += a * a;
+            ab += a * b;
+            bb += b * b;
+            for (int k = 0; k < 3; k++)
+            {
+                ax[k] += a * pixel[k];
+                bx[k] += b * pixel[k];
+            }
+        }
+        float determinant = aa * bb - ab * ab;
+        if (fabsf(determinant) < 1e-6f) break;
+
+        float ends[2][3];
+        for (int k = 0; k < 3; k++)
+        {
+            ends[0][k] = (ax[k] * bb - bx[k] * ab) / determinant;
+            ends[1][k] = (bx[k] * aa - ax[k] * ab) / determinant;
+        }
+        uint16_t n0 = pack_565(ends[0]);
+        uint16_t n1 = pack_565(ends[1]);
+        if (!dxt1_order(&n0, &n1)) break;
+
+        uint8_t trial[16];
+        dxt1_palette(n0, n1, palette);
+        float error = dxt1_nearest_indices(pixels, palette, trial);
+        if (error >= best) break;
+
+        best = error;
+        *c0 = n0;
+        *c1 = n1;
+        memcpy(indices, trial, 16);
+    }
+}
+
+static void compress_dxt1(const block_pixels_t* pixels, int quality, uint8_t out[BLOCK_BYTES])
+{
+    float ends[2][3];
+    dxt1_endpoints(pixels, quality, ends);
+    uint16_t c0 = pack_565(ends[0]);
+    uint16_t c1 = pack_565(ends[1]);
+
+    // Equal endpoints make a three colour block, all index 0 is fine
+    uint8_t indices[16] = { 0 };
+    if (dxt1_order(&c0, &c1))
+    {
+        float palette[4][3];
+        dxt1_palette(c0, c1, palette);
+        if (quality == QUALITY_BEST) dxt1_refine(pixels, &c0, &c1, indices);
+        else dxt1_project_indices(pixels, palette, indices);
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for (int y = 0; y < 4; y++)
+    {
+        const uint8_t* row = &indices[y * 4];
+        out[4 + y] = row[0] | row[1] << 2 | row[2] << 4 | row[3] << 6;
+    }
+}
+
+// Brightness offsets for the selectors +a, +b, -a and -b.
+static const int etc1_modifiers[8][2] =
+{
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+
+typedef struct
+{
+    int     members[8];         // pixels in the half block
+    int     quantized[3];       // base colour, 4 or 5 bits a channel
+    int     table;
+    float   error;
+} etc1_half_t;
+
+static int expand_bits(int value, int bits)
+{
+    return bits == 4 ? value << 4 | value : value << 3 | value >> 2;
+}
+
+// Best table and selectors for half a block around its base colour.
+// The fast quality picks selectors by brightness alone, from 'luma'.
+static float etc1_fit(const block_pixels_t* pixels, const float luma[16], int quality, etc1_half_t* half, int bits, uint8_t selectors[16])
+{
+    float base[3];
+    for (int k = 0; k < 3; k++) base[k] = expand_bits(half->quantized[k], bits);
+    float base_luma = (base[0] + base[1] + base[2]) / 3;
+
+    half->error = FLT_MAX;
+    for (int table = 0; table < 8; table++)
+    {
+        int offsets[4] = { etc1_modifiers[table][0], etc1_modifiers[table][1], -etc1_modifiers[table][0], -etc1_modifiers[table][1] };
+        uint8_t chosen[8];
+        float total = 0;
+        for (int m = 0; m < 8 && total < half->error; m++)
+        {
+            int i = half->members[m];
+            float best = FLT_MAX;
+            for (int s = 0; s < 4; s++)
+            {
+                float error;
+                if (quality == QUALITY_FAST)
+                {
+                    float difference = luma[i] - base_luma - offsets[s];
+                    error = 3 * difference * difference;
+                }
+                else
+                {
+                    float color[3];
+                    for (int k = 0; k < 3; k++) color[k] = MIN(MAX(base[k] + offsets[s], 0), 255);
+                    error = pixel_error(pixels, i, color);
+                }
+                if (error < best)
+                {
+                    best = error;
+                    chosen[m] = s;
+                }
+            }
+            total += best;
+        }
+        if (total < half->error)
+        {
+            half->error = total;
+            half->table = table;
+            for (int m = 0; m < 8; m++) selectors[half->members[m]] = chosen[m];
+        }
+    }
+    return half->error;
+}
+
+// Try the base colours one step either way in each channel around the
+// current one, keeping the best.
+static void etc1_search(const block_pixels_t* pixels, const float luma[16], int quality, etc1_half_t* half, int bits, uint8_t selectors[16])
+{
+    int limit = (1 << bits) - 1;
+    int center[3] = { half->quantized[0], half->quantized[1], half->quantized[2] };
+    etc1_half_t best = *half;
+    uint8_t best_selectors[16];
+    memcpy(best_selectors, selectors, 16);
+
+    for (int n = 0; n < 27; n++)
+    {
+        int step[3] = { n % 3 - 1, n / 3 % 3 - 1, n / 9 - 1 };
+        if (!step[0] && !step[1] && !step[2]) continue;
+        etc1_half_t trial = *half;
+        for (int k = 0; k < 3; k++) trial.quantized[k] = MIN(MAX(center[k] + step[k], 0), limit);
+        if (etc1_fit(pixels, luma, quality, &trial, bits, selectors) < best.error)
+        {
+            best = trial;
+            memcpy(best_selectors, selectors, 16);
+        }
+    }
+    *half = best;
+    memcpy(selectors, best_selectors, 16);
+}
+
+static void compress_etc1(const block_pixels_t* pixels, int quality, uint8_t out[BLOCK_BYTES])
+{
+    static const float brightness[4] = { 1.0f / 3, 1.0f / 3, 1.0f / 3, 0 };
+    float luma[16];
+    kernels.project(pixels->r, pixels->g, pixels->b, 16, brightness, luma);
+
+    float best_error = FLT_MAX;
+    for (int flip = 0; flip < 2; flip++)
+    {
+        // Side by side 2x4 halves, or 4x2 halves one above the other
+        etc1_half_t halves[2];
+        float mean[2][3] = { { 0, 0, 0 }, { 0, 0, 0 } };
+        int counts[2] = { 0, 0 };
+        for (int i = 0; i < 16; i++)
+        {
+            int h = flip ? i / 8 : (i % 4) / 2;
+            halves[h].members[counts[h]++] = i;
+            mean[h][0] += pixels->r[i] / 8;
+            mean[h][1] += pixels->g[i] / 8;
+            mean[h][2] += pixels->b[i] / 8;
+        }
+
+        for (int differential = 1; differential >= 0; differential--)
+        {
+            int bits = differential ? 5 : 4;
+            int limit = (1 << bits) - 1;
+            for (int h = 0; h < 2; h++)
+            {
+                for (int k = 0; k < 3; k++) halves[h].quantized[k] = (int)(mean[h][k] * limit / 255 + 0.5f);
+            }
+
+            // The second base colour is stored as a 3 bit difference
+            int fits = 1;
+            for (int k = 0; k < 3; k++)
+            {
+                int delta = halves[1].quantized[k] - halves[0].quantized[k];
+                if (differential && (delta < -4 || delta > 3)) fits = 0;
+            }
+            if (!fits) continue;
+
+            uint8_t selectors[16];
+            etc1_fit(pixels, luma, quality, &halves[0], bits, selectors);
+            etc1_fit(pixels, luma, quality, &halves[1], bits, selectors);
+
+            if (quality == QUALITY_BEST)
+            {
+                etc1_half_t fitted[2] = { halves[0], halves[1] };
+                uint8_t fitted_selectors[16];
+                memcpy(fitted_selectors, selectors, 16);
+                etc1_search(pixels, luma, quality, &halves[0], bits, selectors);
+                etc1_search(pixels, luma, quality, &halves[1], bits, selectors);
+
+                for (int k = 0; k < 3 && differential; k++)
+                {
+                    int delta = halves[1].quantized[k] - halves[0].quantized[k];
+                    if (delta < -4 || delta > 3) fits = 0;
+                }
+                if (!fits)
+                {
+                    halves[0] = fitted[0];
+                    halves[1] = fitted[1];
+                    memcpy(selectors, fitted_selectors, 16);
+                }
+            }
+
+            float error = halves[0].error + halves[1].error;
+            if (error >= best_error) continue;
+            best_error = error;
+
+            for (int k = 0; k < 3; k++)
+            {
+                if (differential) out[k] = halves[0].quantized[k] << 3 | ((halves[1].quantized[k] - halves[0].quantized[k]) & 7);
+                else out[k] = halves[0].quantized[k] << 4 | halves[1].quantized[k];
+            }
+            out[3] = halves[0].table << 5 | halves[1].table << 2 | differential << 1 | flip;
+
+            // Selectors go column by column, high bits then low bits
+            uint32_t high = 0, low = 0;
+            for (int i = 0; i < 16; i++)
+            {
+                int bit = (i % 4) * 4 + i / 4;
+                high |= (uint32_t)(selectors[i] >> 1) << bit;
+                low |= (uint32_t)(selectors[i] & 1) << bit;
+            }
+            out[4] = high >> 8;
+            out[5] = high & 0xff;
+            out[6] = low >> 8;
+            out[7] = low & 0xff;
+
+            // Fast settles for the first mode that fits
+            if (quality == QUALITY_FAST) break;
+        }
+    }
+}
+
+static const block_format_t block_formats[BLOCK_FORMATS] =
+{
+    { "dxt1", compress_dxt1 },
+    { "etc1", compress_etc1 },
+};
+
+uint32_t compressed_size(int width, int height)
+{
+    return (uint32_t)((width + 3) / 4) * ((height + 3) / 4) * BLOCK_BYTES;
+}
+
+// Compress a width x height RGBA image to blocks, row by row.
+void compress_image(const block_format_t* format, int quality, const uint8_t* rgba, int width, int height, uint8_t* out)
+{
+    for (int by = 0; by < height; by += 4)
+    {
+        for (int bx = 0; bx < width; bx += 4)
+        {
+            block_pixels_t pixels;
+            for (int i = 0; i < 16; i++)
+            {
+                int x = MIN(bx + i % 4, width - 1);
+                int y = MIN(by + i / 4, height - 1);
+                const uint8_t* texel = &rgba[(y * width + x) * 4];
+                pixels.r[i] = texel[0];
+                pixels.g[i] = texel[1];
+                pixels.b[i] = texel[2];
+            }
+            format->compress(&pixels, quality, out);
+            out += BLOCK_BYTES;
+        }
+    }
+}
+
+// A bit per format in block_formats, from a list like "dxt1,etc1".
+int parse_block_formats(const char* list)
+{
+    int formats = 0;
+    for (const char* name = list; *name; )
+    {
+        size_t length = strcspn(name, ",");
+        int found = 0;
+        for (int i = 0; i < BLOCK_FORMATS; i++)
+        {
+            if (strlen(block_formats[i].name) == length && !strncmp(name, block_formats[i].name, length))
+            {
+                formats |= 1 << i;
+                found = 1;
+            }
+        }
+        if (!found) fatal("Unknown texture format '%.*s'", (int)length, name);
+        name += length;
+        if (*name == ',') name++;
+    }
+    return formats;
+}
+
+int parse_quality(const char* name)
+{
+    static const char* names[] = { "fast", "normal", "best" };
+    for (int i = 0; i < 3; i++)
+    {
+        if (!strcmp(name, names[i])) return i;
+    }
+    fatal("Unknown quality '%s'", name);
+    return QUALITY_NORMAL;
+}
@@ -1,10 +1,10 @@
-# ./bsp2json/build/Release/bsp2json output/maps/start.bsp > start.bsp.json
-# iconv -f UTF8 -t ASCII start.bsp.json | python entities2json.py > public/start.bsp.processed.json 
+# ./bsp2json-c pak0.pak:maps/start.bsp
+# python entities2json.py start.bsp.entities.json > public/start.bsp.entities.json
 import sys
 import json
 
-data = sys.stdin.read()
-data = json.loads(data)
+# The raw entities lump, as bsp2json writes it
+data = open(sys.argv[1], 'rb').read().decode('latin-1').rstrip('\0')
 
 def process_entities(raw_entities):
   entities = []
@@ -26,7 +26,5 @@ def process_entities(raw_entities):
       entity[tokens[1]] = tokens[3]
   return entities
 
-data['entities'] = process_entities(data['entities'])
-
-print(json.dumps(data, indent=2))
+print(json.dumps(process_entities(data), indent=2))
 
@@ -0,0 +1,307 @@
+// Shortest round trip float to text.
+//
+// format_float() writes the shortest decimal string that reads back as
+// exactly the same float, which %g neither guarantees (it stops at six
+// digits) nor does quickly. The digits come from Ulf Adams' Ryu
+// algorithm ("Ryu: fast float-to-string conversion", PLDI 2018), the
+// 32 bit variant, which needs only integer arithmetic and two small
+// tables of powers of five.
+
+#define FLOAT_MANTISSA_BITS     23
+#define FLOAT_EXPONENT_BITS     8
+#define FLOAT_BIAS              127
+
+#define FLOAT_POW5_INV_BITCOUNT 59
+#define FLOAT_POW5_BITCOUNT     61
+
+// floor(2^(bits(5^i) - 1 + 59) / 5^i) + 1
+static const uint64_t FLOAT_POW5_INV_SPLIT[31] =
+{
+    576460752303423489u, 461168601842738791u, 368934881474191033u,
+    295147905179352826u, 472236648286964522u, 377789318629571618u,
+    302231454903657294u, 483570327845851670u, 386856262276681336u,
+    309485009821345069u, 495176015714152110u, 396140812571321688u,
+    316912650057057351u, 507060240091291761u, 405648192073033409u,
+    324518553658426727u, 519229685853482763u, 415383748682786211u,
+    332306998946228969u, 531691198313966350u, 425352958651173080u,
+    340282366920938464u, 544451787073501542u, 435561429658801234u,
+    348449143727040987u, 557518629963265579u, 446014903970612463u,
+    356811923176489971u, 570899077082383953u, 456719261665907162u,
+    365375409332725730u,
+};
+
+// 5^i, normalized to 61 bits
+static const uint64_t FLOAT_POW5_SPLIT[48] =
+{
+    1152921504606846976u, 1441151880758558720u, 1801439850948198400u,
+    2251799813685248000u, 1407374883553280000u, 1759218604441600000u,
+    2199023255552000000u, 1374389534720000000u, 1717986918400000000u,
+    2147483648000000000u, 1342177280000000000u, 1677721600000000000u,
+    2097152000000000000u, 1310720000000000000u, 1638400000000000000u,
+    2048000000000000000u, 1280000000000000000u, 1600000000000000000u,
+    2000000000000000000u, 1250000000000000000u, 1562500000000000000u,
+    1953125000000000000u, 1220703125000000000u, 1525878906250000000u,
+    1907348632812500000u, 1192092895507812500u, 1490116119384765625u,
+    1862645149230957031u, 1164153218269348144u, 1455191522836685180u,
+    1818989403545856475u, 2273736754432320594u, 1421085471520200371u,
+    1776356839400250464u, 2220446049250313080u, 1387778780781445675u,
+    1734723475976807094u, 2168404344971008868u, 1355252715606880542u,
+    1694065894508600678u, 2117582368135750847u, 1323488980084844279u,
+    1654361225106055349u, 2067951531382569187u, 1292469707114105741u,
+    1615587133892632177u, 2019483917365790221u, 1262177448353618888u,
+};
+
+// Number of bits in 5^e, for 0 <= e <= 3528
+static int32_t pow5bits(int32_t e)
+{
+    return (int32_t)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e)) for 0 <= e <= 1650
+static uint32_t log10_pow2(int32_t e)
+{
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+// floor(log10(5^e)) for 0 <= e <= 2620
+static uint32_t log10_pow5(int32_t e)
+{
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+static uint32_t pow5_factor(uint32_t value)
+{
+    uint32_t count = 0;
+    for (; value % 5 == 0; value /= 5) count++;
+    return count;
+}
+
+static int multiple_of_pow5(uint32_t value, uint32_t p)
+{
+    return pow5_factor(value) >= p;
+}
+
+static int multiple_of_pow2(uint32_t value, uint32_t p)
+{
+    return (value & ((1u << p) - 1)) == 0;
+}
+
+// (m * factor) >> shift, with shift > 32
+static uint32_t mul_shift(uint32_t m, uint64_t factor, int32_t shift)
+{
+    uint64_t low  = (uint64_t)m * (uint32_t)factor;
+    uint64_t high = (uint64_t)m * (uint32_t)(factor >> 32);
+    uint64_t sum  = (low >> 32) + high;
+    return (uint32_t)(sum >> (shift - 32));
+}
+
+// The shortest decimal mantissa and exponent for a finite, non zero
+// float given as its raw bits.
+static void float_to_decimal(uint32_t ieee_mantissa, uint32_t ieee_exponent, uint32_t* mantissa, int32_t* exponent)
+{
+    int32_t e2;
+    uint32_t m2;
+    if (ieee_exponent == 0)
+    {
+        e2 = 1 - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    }
+    else
+    {
+        e2 = (int32_t)ieee_exponent - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = (1u << FLOAT_MANTISSA_BITS) | ieee_mantissa;
+    }
+    int accept_bounds = (m2 & 1) == 0;
+
+    // The interval of decimals that round to this float, scaled by 4
+    uint32_t mv = 4 * m2;
+    uint32_t mp = 4 * m2 + 2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    uint32_t mm = 4 * m2 - 1 - mm_shift;
+
+    // Convert the interval to a power of ten base
+    uint32_t vr, vp, vm;
+    int32_t e10;
+    int vm_trailing_zeros = 0;
+    int vr_trailing_zeros = 0;
+    uint32_t last_removed_digit = 0;
+
+    if (e2 >= 0)
+    {
+        uint32_t q = log10_pow2(e2);
+        e10 = (int32_t)q;
+        int32_t k = FLOAT_POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+        vr = mul_shift(mv, FLOAT_POW5_INV_SPLIT[q], i);
+        vp = mul_shift(mp, FLOAT_POW5_INV_SPLIT[q], i);
+        vm = mul_shift(mm, FLOAT_POW5_INV_SPLIT[q], i);
+
+        if (q != 0 && (vp - 1) / 10 <= vm / 10)
+        {
+            // The loop below won't run, but the digit it would have
+            // removed is still needed for rounding.
+            int32_t l = FLOAT_POW5_INV_BITCOUNT + pow5bits(q - 1) - 1;
+            last_removed_digit = mul_shift(mv, FLOAT_POW5_INV_SPLIT[q - 1], -e2 + (int32_t)q - 1 + l) % 10;
+        }
+        if (q <= 9)
+        {
+            // Only one of mp, mv and mm can be a multiple of 5, if any
+            if (mv % 5 == 0) vr_trailing_zeros = multiple_of_pow5(mv, q);
+            else if (accept_bounds) vm_trailing_zeros = multiple_of_pow5(mm, q);
+            else vp -= multiple_of_pow5(mp, q);
+        }
+    }
+    else
+    {
+        uint32_t q = log10_pow5(-e2);
+        e10 = (int32_t)q + e2;
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = pow5bits(i) - FLOAT_POW5_BITCOUNT;
+        int32_t j = (int32_t)q - k;
+        vr = mul_shift(mv, FLOAT_POW5_SPLIT[i], j);
+        vp = mul_shift(mp, FLOAT_POW5_SPLIT[i], j);
+        vm = mul_shift(mm, FLOAT_POW5_SPLIT[i], j);
+
+        if (q != 0 && (vp - 1) / 10 <= vm / 10)
+        {
+            j = (int32_t)q - 1 - (pow5bits(i + 1) - FLOAT_POW5_BITCOUNT);
+            last_removed_digit = mul_shift(mv, FLOAT_POW5_SPLIT[i + 1], j) % 10;
+        }
+        if (q <= 1)
+        {
+            // mv = 4 * m2 always has at least two trailing zero bits
+            vr_trailing_zeros = 1;
+            if (accept_bounds) vm_trailing_zeros = mm_shift == 1;
+            else vp--;
+        }
+        else if (q < 31)
+        {
+            vr_trailing_zeros = multiple_of_pow2(mv, q - 1);
+        }
+    }
+
+    // Drop digits while the interval still holds a shorter decimal
+    int32_t removed = 0;
+    uint32_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros)
+    {
+        while (vp / 10 > vm / 10)
+        {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed_digit == 0;
+            last_removed_digit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros)
+        {
+            while (vm % 10 == 0)
+            {
+                vr_trailing_zeros &= last_removed_digit == 0;
+                last_removed_digit = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        // Round half to even when the exact value is ...50000
+        if (vr_trailing_zeros && last_removed_digit == 5 && vr % 2 == 0) last_removed_digit = 4;
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed_digit >= 5);
+    }
+    else
+    {
+        // The common case, without any exact trailing zeros to track
+        while (vp / 10 > vm / 10)
+        {
+            last_removed_digit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || last_removed_digit >= 5);
+    }
+
+    *mantissa = output;
+    *exponent = e10 + removed;
+}
+
+// Write 'value' to 'out', which needs room for 16 characters, and
+// return how many were written (there's no terminating null).
+// Numbers look the way %g prints them, "128", "0.5", "1.5e-07", but
+// with as many digits as it takes to read back the same float.
+static int format_float(float value, char* out)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t ieee_mantissa = bits & ((1u << FLOAT_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (bits >> FLOAT_MANTISSA_BITS) & ((1u << FLOAT_EXPONENT_BITS) - 1);
+    char* start = out;
+
+    if (bits >> 31) *out++ = '-';
+
+    if (ieee_exponent == (1u << FLOAT_EXPONENT_BITS) - 1)
+    {
+        if (ieee_mantissa) out = start;
+        memcpy(out, ieee_mantissa ? "nan" : "inf", 3);
+        return out + 3 - start;
+    }
+    if (ieee_exponent == 0 && ieee_mantissa == 0)
+    {
+        *out++ = '0';
+        return out - start;
+    }
+
+    uint32_t mantissa;
+    int32_t exponent;
+    float_to_decimal(ieee_mantissa, ieee_exponent, &mantissa, &exponent);
+
+    // Digits, least significant first
+    char digits[10];
+    int length = 0;
+    for (uint32_t m = mantissa; m; m /= 10) digits[length++] = '0' + m % 10;
+
+    // The value is d.ddd * 10^scientific
+    int32_t scientific = exponent + length - 1;
+
+    if (scientific < -4 || scientific >= 9)
+    {
+        *out++ = digits[length - 1];
+        if (length > 1) *out++ = '.';
+        for (int i = length - 2; i >= 0; i--) *out++ = digits[i];
+
+        int32_t magnitude = scientific < 0 ? -scientific : scientific;
+        *out++ = 'e';
+        *out++ = scientific < 0 ? '-' : '+';
+        *out++ = '0' + magnitude / 10;
+        *out++ = '0' + magnitude % 10;
+    }
+    else if (exponent >= 0)
+    {
+        // 15e1 => 150
+        for (int i = length - 1; i >= 0; i--) *out++ = digits[i];
+        for (int32_t i = 0; i < exponent; i++) *out++ = '0';
+    }
+    else if (scientific >= 0)
+    {
+        // 125e-2 => 1.25
+        for (int i = length - 1; i >= 0; i--)
+        {
+            *out++ = digits[i];
+            if (i == -exponent) *out++ = '.';
+        }
+    }
+    else
+    {
+        // 25e-3 => 0.025
+        *out++ = '0';
+        *out++ = '.';
+        for (int32_t i = -1; i > scientific; i--) *out++ = '0';
+        for (int i = length - 1; i >= 0; i--) *out++ = digits[i];
+    }
+    return out - start;
+}
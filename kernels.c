@@ -0,0 +1,166 @@
+// Batched geometry kernels over structure of arrays data.
+//
+// Each kernel has a scalar version and, on x86, SSE and AVX2 versions.
+// init_kernels() picks the widest the CPU supports at run time, and
+// callers go through the 'kernels' table, so the program itself is
+// still built for the baseline instruction set.
+//
+// The vector versions do the same float operations in the same order
+// as the scalar ones, and give bit for bit the same results.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+typedef struct
+{
+    const char* name;
+
+    // Smallest and largest of 'count' floats, count > 0.
+    void (*range)(const float* values, int count, float* min, float* max);
+
+    // out[i] = x[i] * axis[0] + y[i] * axis[1] + z[i] * axis[2] + axis[3]
+    void (*project)(const float* x, const float* y, const float* z, int count, const float axis[4], float* out);
+} kernels_t;
+
+static kernels_t kernels;
+
+static void range_scalar(const float* values, int count, float* min, float* max)
+{
+    float low = values[0];
+    float high = values[0];
+    for (int i = 1; i < count; i++)
+    {
+        low = MIN(low, values[i]);
+        high = MAX(high, values[i]);
+    }
+    *min = low;
+    *max = high;
+}
+
+// Starting the sum from 0 as dotproduct() does turns a -0 product into
+// +0, so the vector versions add the zero too.
+static void project_scalar(const float* x, const float* y, const float* z, int count, const float axis[4], float* out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        float sum = 0;
+        sum += x[i] * axis[0];
+        sum += y[i] * axis[1];
+        sum += z[i] * axis[2];
+        out[i] = sum + axis[3];
+    }
+}
+
+#ifdef KERNELS_X86
+
+static void range_sse(const float* values, int count, float* min, float* max)
+{
+    if (count < 4)
+    {
+        range_scalar(values, count, min, max);
+        return;
+    }
+
+    // Overlapping the last load with the previous ones is harmless
+    __m128 low = _mm_loadu_ps(values);
+    __m128 high = low;
+    for (int i = 4; i < count; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(&values[MIN(i, count - 4)]);
+        low = _mm_min_ps(low, v);
+        high = _mm_max_ps(high, v);
+    }
+
+    float lows[4], highs[4];
+    _mm_storeu_ps(lows, low);
+    _mm_storeu_ps(highs, high);
+    float unused;
+    range_scalar(lows, 4, min, &unused);
+    range_scalar(highs, 4, &unused, max);
+}
+
+static void project_sse(const float* x, const float* y, const float* z, int count, const float axis[4], float* out)
+{
+    __m128 ax = _mm_set1_ps(axis[0]);
+    __m128 ay = _mm_set1_ps(axis[1]);
+    __m128 az = _mm_set1_ps(axis[2]);
+    __m128 offset = _mm_set1_ps(axis[3]);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 sum = _mm_add_ps(_mm_setzero_ps(), _mm_mul_ps(_mm_loadu_ps(&x[i]), ax));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&y[i]), ay));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&z[i]), az));
+        _mm_storeu_ps(&out[i], _mm_add_ps(sum, offset));
+    }
+    project_scalar(&x[i], &y[i], &z[i], count - i, axis, &out[i]);
+}
+
+__attribute__((target("avx2")))
+static void range_avx2(const float* values, int count, float* min, float* max)
+{
+    if (count < 8)
+    {
+        range_sse(values, count, min, max);
+        return;
+    }
+
+    __m256 low = _mm256_loadu_ps(values);
+    __m256 high = low;
+    for (int i = 8; i < count; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps(&values[MIN(i, count - 8)]);
+        low = _mm256_min_ps(low, v);
+        high = _mm256_max_ps(high, v);
+    }
+
+    float lows[8], highs[8];
+    _mm256_storeu_ps(lows, low);
+    _mm256_storeu_ps(highs, high);
+    float unused;
+    range_scalar(lows, 8, min, &unused);
+    range_scalar(highs, 8, &unused, max);
+}
+
+__attribute__((target("avx2")))
+static void project_avx2(const float* x, const float* y, const float* z, int count, const float axis[4], float* out)
+{
+    __m256 ax = _mm256_set1_ps(axis[0]);
+    __m256 ay = _mm256_set1_ps(axis[1]);
+    __m256 az = _mm256_set1_ps(axis[2]);
+    __m256 offset = _mm256_set1_ps(axis[3]);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 sum = _mm256_add_ps(_mm256_setzero_ps(), _mm256_mul_ps(_mm256_loadu_ps(&x[i]), ax));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(&y[i]), ay));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(&z[i]), az));
+        _mm256_storeu_ps(&out[i], _mm256_add_ps(sum, offset));
+    }
+    project_sse(&x[i], &y[i], &z[i], count - i, axis, &out[i]);
+}
+
+#endif
+
+// 'name' is "scalar", "sse" or "avx2" to force a version (for testing),
+// or NULL for the best one available.
+void init_kernels(const char* name)
+{
+    static const kernels_t scalar = { "scalar", range_scalar, project_scalar };
+    kernels = scalar;
+
+#ifdef KERNELS_X86
+    static const kernels_t sse = { "sse", range_sse, project_sse };
+    static const kernels_t avx2 = { "avx2", range_avx2, project_avx2 };
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2") && (!name || !strcmp(name, "sse"))) kernels = sse;
+    if (__builtin_cpu_supports("avx2") && (!name || !strcmp(name, "avx2"))) kernels = avx2;
+#endif
+
+    if (name && strcmp(name, kernels.name)) fatal("Kernels '%s' aren't available", name);
+}
@@ -0,0 +1,451 @@
+// The triangle mesh bsp2json builds up before writing it out.
+//
+// Every vertex is VERTEX_FLOATS floats, interleaved as
+//   position (3) normal (3) color (3) texcoord (2) 1
+// followed, in meshes with a lightmap atlas, by
+//   lightmap texcoord (2)
+// which is also the layout of the binary vertex blob.
+
+#define VERTEX_FLOATS           12
+#define LIGHTMAP_VERTEX_FLOATS  14
+
+// A run of triangles in the index buffer from one model that share
+// a texture.
+typedef struct
+{
+    uint32_t model;
+    uint32_t texture;           // index of the miptex
+    uint32_t lightmap;          // lightmap atlas page
+    uint32_t leaf;              // when the triangles are grouped by leaf, or 0
+    uint32_t node;              // when they're grouped by BSP node, or 0
+    uint32_t chunk;
+    uint32_t first_index;
+    uint32_t num_indices;
+} draw_t;
+
+// A range of the vertex buffer, and the range of the index buffer
+// whose indices are relative to the start of it.
+typedef struct
+{
+    uint32_t first_vertex;
+    uint32_t num_vertices;
+    uint32_t first_index;
+    uint32_t num_indices;
+} chunk_t;
+
+typedef struct
+{
+    uint32_t  stride;           // floats per vertex
+    float*    vertices;
+    uint32_t  num_vertices;
+    uint32_t  max_vertices;
+    uint32_t* indices;          // three per triangle
+    uint32_t  num_indices;
+    uint32_t  max_indices;
+    draw_t*   draws;            // one per face until batch_draws()
+    uint32_t  num_draws;
+    uint32_t  max_draws;
+    chunk_t*  chunks;           // set by chunk_mesh()
+    uint32_t  num_chunks;
+} mesh_t;
+
+// 'stride' is VERTEX_FLOATS or LIGHTMAP_VERTEX_FLOATS
+static void init_mesh(mesh_t* mesh, uint32_t stride)
+{
+    memset(mesh, 0, sizeof(mesh_t));
+    mesh->stride = stride;
+}
+
+static void free_mesh(mesh_t* mesh)
+{
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh->draws);
+    free(mesh->chunks);
+    init_mesh(mesh, mesh->stride);
+}
+
+// Returns the floats of the new vertex to fill in.
+static float* mesh_add_vertex(mesh_t* mesh)
+{
+    if (mesh->num_vertices == mesh->max_vertices)
+    {
+        mesh->max_vertices = MAX(1024, mesh->max_vertices * 2);
+        mesh->vertices = realloc(mesh->vertices, mesh->max_vertices * mesh->stride * sizeof(float));
+    }
+    return &mesh->vertices[mesh->stride * mesh->num_vertices++];
+}
+
+static void mesh_add_triangle(mesh_t* mesh, uint32_t a, uint32_t b, uint32_t c)
+{
+    if (mesh->num_indices + 3 > mesh->max_indices)
+    {
+        mesh->max_indices = MAX(3072, mesh->max_indices * 2);
+        mesh->indices = realloc(mesh->indices, mesh->max_indices * sizeof(uint32_t));
+    }
+    uint32_t* triangle = &mesh->indices[mesh->num_indices];
+    triangle[0] = a;
+    triangle[1] = b;
+    triangle[2] = c;
+    mesh->num_indices += 3;
+}
+
+// Start a new draw at the end of the index buffer, the triangles
+// added after it belong to it.
+static void mesh_begin_draw(mesh_t* mesh, uint32_t model, uint32_t texture)
+{
+    if (mesh->num_draws == mesh->max_draws)
+    {
+        mesh->max_draws = MAX(256, mesh->max_draws * 2);
+        mesh->draws = realloc(mesh->draws, mesh->max_draws * sizeof(draw_t));
+    }
+    draw_t* draw = &mesh->draws[mesh->num_draws++];
+    draw->model = model;
+    draw->texture = texture;
+    draw->lightmap = 0;
+    draw->leaf = 0;
+    draw->node = 0;
+    draw->chunk = mesh->num_chunks ? mesh->num_chunks - 1 : 0;
+    draw->first_index = mesh->num_indices;
+    draw->num_indices = 0;
+}
+
+static void mesh_end_draw(mesh_t* mesh)
+{
+    draw_t* draw = &mesh->draws[mesh->num_draws - 1];
+    draw->num_indices = mesh->num_indices - draw->first_index;
+}
+
+// Make room for at least this many vertices, indices and draws.
+static void reserve_mesh(mesh_t* mesh, uint32_t num_vertices, uint32_t num_indices, uint32_t num_draws)
+{
+    if (num_vertices > mesh->max_vertices)
+    {
+        mesh->max_vertices = MAX(num_vertices, mesh->max_vertices * 2);
+        mesh->vertices = realloc(mesh->vertices, mesh->max_vertices * mesh->stride * sizeof(float));
+    }
+    if (num_indices > mesh->max_indices)
+    {
+        mesh->max_indices = MAX(num_indices, mesh->max_indices * 2);
+        mesh->indices = realloc(mesh->indices, mesh->max_indices * sizeof(uint32_t));
+    }
+    if (num_draws > mesh->max_draws)
+    {
+        mesh->max_draws = MAX(num_draws, mesh->max_draws * 2);
+        mesh->draws = realloc(mesh->draws, mesh->max_draws * sizeof(draw_t));
+    }
+}
+
+// Append the triangles and draws of 'source' to 'mesh'. Vertex v of
+// 'source' becomes remap[v], which the caller has already added, or
+// with no 'remap' all of its vertices are copied after the existing.
+static void mesh_append(mesh_t* mesh, const mesh_t* source, const uint32_t* remap)
+{
+    uint32_t base = mesh->num_vertices;
+    if (!remap)
+    {
+        reserve_mesh(mesh, base + source->num_vertices, 0, 0);
+        memcpy(&mesh->vertices[base * mesh->stride], source->vertices, source->num_vertices * mesh->stride * sizeof(float));
+        mesh->num_vertices += source->num_vertices;
+    }
+
+    reserve_mesh(mesh, 0, mesh->num_indices + source->num_indices, mesh->num_draws + source->num_draws);
+    uint32_t* indices = &mesh->indices[mesh->num_indices];
+    for (uint32_t i = 0; i < source->num_indices; i++)
+    {
+        uint32_t v = source->indices[i];
+        indices[i] = remap ? remap[v] : base + v;
+    }
+
+    for (uint32_t i = 0; i < source->num_draws; i++)
+    {
+        draw_t* draw = &mesh->draws[mesh->num_draws++];
+        *draw = source->draws[i];
+        draw->first_index += mesh->num_indices;
+    }
+    mesh->num_indices += source->num_indices;
+}
+
+static int compare_draws(const void* a, const void* b)
+{
+    const draw_t* x = a;
+    const draw_t* y = b;
+    if (x->model != y->model) return x->model < y->model ? -1 : 1;
+    if (x->leaf != y->leaf) return x->leaf < y->leaf ? -1 : 1;
+    if (x->node != y->node) return x->node < y->node ? -1 : 1;
+    if (x->texture != y->texture) return x->texture < y->texture ? -1 : 1;
+    if (x->lightmap != y->lightmap) return x->lightmap < y->lightmap ? -1 : 1;
+    // Keep the original order within a texture
+    return x->first_index < y->first_index ? -1 : x->first_index > y->first_index;
+}
+
+// Replace the draws with 'count' of the existing ones, in 'order' and
+// tagged with 'leaves'. A draw may be left out or listed several times,
+// in which case its indices are too, but not its vertices.
+static void select_draws(mesh_t* mesh, const uint32_t* order, const uint32_t* leaves, uint32_t count)
+{
+    uint32_t num_indices = 0;
+    for (uint32_t i = 0; i < count; i++) num_indices += mesh->draws[order[i]].num_indices;
+
+    uint32_t* indices = malloc(MAX(num_indices, 1) * sizeof(uint32_t));
+    draw_t* draws = malloc(MAX(count, 1) * sizeof(draw_t));
+    num_indices = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        draw_t* draw = &draws[i];
+        *draw = mesh->draws[order[i]];
+        memcpy(&indices[num_indices], &mesh->indices[draw->first_index], draw->num_indices * sizeof(uint32_t));
+        draw->first_index = num_indices;
+        draw->leaf = leaves[i];
+        num_indices += draw->num_indices;
+    }
+
+    free(mesh->indices);
+    free(mesh->draws);
+    mesh->indices = indices;
+    mesh->num_indices = mesh->max_indices = num_indices;
+    mesh->draws = draws;
+    mesh->num_draws = mesh->max_draws = count;
+}
+
+// Reorder the index buffer so that all the triangles of a model using
+// a texture (and lightmap page) are contiguous, and merge the draws
+// down to one per model and texture. Draws tagged with a leaf or node
+// are grouped by it first.
+static void batch_draws(mesh_t* mesh)
+{
+    qsort(mesh->draws, mesh->num_draws, sizeof(draw_t), compare_draws);
+
+    uint32_t* indices = malloc(mesh->max_indices * sizeof(uint32_t));
+    uint32_t num_indices = 0;
+    uint32_t num_draws = 0;
+
+    for (uint32_t i = 0; i < mesh->num_draws; i++)
+    {
+        draw_t draw = mesh->draws[i];
+        if (!draw.num_indices) continue;
+
+        memcpy(&indices[num_indices], &mesh->indices[draw.first_index], draw.num_indices * sizeof(uint32_t));
+
+        draw_t* last = num_draws ? &mesh->draws[num_draws - 1] : NULL;
+        if (last && last->model == draw.model && last->leaf == draw.leaf && last->node == draw.node && last->texture == draw.texture && last->lightmap == draw.lightmap)
+        {
+            last->num_indices += draw.num_indices;
+        }
+        else
+        {
+            draw.first_index = num_indices;
+            mesh->draws[num_draws++] = draw;
+        }
+        num_indices += draw.num_indices;
+    }
+
+    free(mesh->indices);
+    mesh->indices = indices;
+    mesh->num_draws = num_draws;
+}
+
+// What makes a vertex emitted for one face the same as one emitted
+// for another. Position and texture coordinates follow from the BSP
+// vertex and texinfo, so those are used instead of the floats.
+typedef struct
+{
+    uint32_t vertex;            // index into the BSP vertex lump
+    uint32_t texinfo;
+    float    normal[3];
+    float    light;
+    uint32_t face;              // with a lightmap atlas, as each face has its own
+} weld_key_t;
+
+// Open addressing (linear probing) map from weld_key_t to the index
+// of the mesh vertex emitted for it.
+typedef struct
+{
+    weld_key_t* keys;
+    uint32_t*   values;         // mesh vertex index + 1, or 0 if empty
+    uint32_t    capacity;       // always a power of two
+    uint32_t    count;
+} weld_table_t;
+
+static void init_weld_table(weld_table_t* table, uint32_t capacity)
+{
+    table->capacity = 1024;
+    while (table->capacity < capacity) table->capacity *= 2;
+    table->count = 0;
+    table->keys = malloc(table->capacity * sizeof(weld_key_t));
+    table->values = calloc(table->capacity, sizeof(uint32_t));
+}
+
+static void free_weld_table(weld_table_t* table)
+{
+    free(table->keys);
+    free(table->values);
+    memset(table, 0, sizeof(weld_table_t));
+}
+
+static uint32_t hash_weld_key(const weld_key_t* key)
+{
+    uint32_t words[sizeof(weld_key_t) / sizeof(uint32_t)];
+    memcpy(words, key, sizeof(words));
+
+    uint32_t hash = 0;
+    for (size_t i = 0; i < sizeof(words) / sizeof(uint32_t); i++)
+    {
+        hash = (hash ^ words[i]) * 0x9e3779b1u;
+        hash ^= hash >> 15;
+    }
+    // murmur3 finalizer
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static uint32_t* find_weld_slot(weld_table_t* table, const weld_key_t* key)
+{
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = hash_weld_key(key) & mask; ; i = (i + 1) & mask)
+    {
+        if (!table->values[i]) return &table->values[i];
+        if (!memcmp(&table->keys[i], key, sizeof(weld_key_t))) return &table->values[i];
+    }
+}
+
+static void grow_weld_table(weld_table_t* table)
+{
+    weld_table_t old = *table;
+    init_weld_table(table, old.capacity * 2);
+
+    for (uint32_t i = 0; i < old.capacity; i++)
+    {
+        if (!old.values[i]) continue;
+        uint32_t* slot = find_weld_slot(table, &old.keys[i]);
+        table->keys[slot - table->values] = old.keys[i];
+        *slot = old.values[i];
+        table->count++;
+    }
+    free_weld_table(&old);
+}
+
+// Returns the vertex already recorded for 'key', or records and
+// returns 'vertex' if there isn't one yet.
+static uint32_t weld_vertex(weld_table_t* table, const weld_key_t* key, uint32_t vertex)
+{
+    // Keep the table at most half full
+    if (2 * (table->count + 1) > table->capacity) grow_weld_table(table);
+
+    uint32_t* slot = find_weld_slot(table, key);
+    if (*slot) return *slot - 1;
+
+    table->keys[slot - table->values] = *key;
+    *slot = vertex + 1;
+    table->count++;
+    return vertex;
+}
+
+static void begin_chunk(mesh_t* mesh)
+{
+    mesh->chunks = realloc(mesh->chunks, (mesh->num_chunks + 1) * sizeof(chunk_t));
+    chunk_t* chunk = &mesh->chunks[mesh->num_chunks++];
+    chunk->first_vertex = mesh->num_vertices;
+    chunk->num_vertices = 0;
+    chunk->first_index = mesh->num_indices;
+    chunk->num_indices = 0;
+}
+
+static void end_chunk(mesh_t* mesh)
+{
+    chunk_t* chunk = &mesh->chunks[mesh->num_chunks - 1];
+    chunk->num_vertices = mesh->num_vertices - chunk->first_vertex;
+    chunk->num_indices = mesh->num_indices - chunk->first_index;
+}
+
+// A draw continuing 'draw' in the chunked mesh.
+static void begin_chunk_draw(mesh_t* chunked, const draw_t* draw)
+{
+    mesh_begin_draw(chunked, draw->model, draw->texture);
+    draw_t* copy = &chunked->draws[chunked->num_draws - 1];
+    copy->lightmap = draw->lightmap;
+    copy->leaf = draw->leaf;
+    copy->node = draw->node;
+}
+
+// End the draw, dropping it if no triangles went into it, as when its
+// first triangle already needed a new chunk.
+static void end_chunk_draw(mesh_t* chunked)
+{
+    mesh_end_draw(chunked);
+    if (!chunked->draws[chunked->num_draws - 1].num_indices) chunked->num_draws--;
+}
+
+// Split the mesh into chunks of at most 'max_vertices' vertices each,
+// so that indices relative to the chunk fit in 16 bits. Each chunk
+// gets its own copy of the vertices it uses, laid out in the order
+// they are first used; draws that straddle two chunks are split.
+static void chunk_mesh(mesh_t* mesh, uint32_t max_vertices)
+{
+    mesh_t chunked;
+    init_mesh(&chunked, mesh->stride);
+    begin_chunk(&chunked);
+
+    // The output vertex of each input vertex, valid only if it
+    // was emitted into the current chunk.
+    uint32_t* vertex_chunk = malloc(mesh->num_vertices * sizeof(uint32_t));
+    uint32_t* vertex_index = malloc(mesh->num_vertices * sizeof(uint32_t));
+    memset(vertex_chunk, 0xff, mesh->num_vertices * sizeof(uint32_t));
+
+    for (uint32_t d = 0; d < mesh->num_draws; d++)
+    {
+        const draw_t* draw = &mesh->draws[d];
+        begin_chunk_draw(&chunked, draw);
+
+        for (uint32_t i = draw->first_index; i < draw->first_index + draw->num_indices; i += 3)
+        {
+            const uint32_t* triangle = &mesh->indices[i];
+            uint32_t chunk = chunked.num_chunks - 1;
+
+            uint32_t needed = 0;
+            for (int k = 0; k < 3; k++)
+            {
+                // Degenerate triangles may repeat a vertex
+                int repeat = (k > 0 && triangle[k] == triangle[0]) || (k > 1 && triangle[k] == triangle[1]);
+                if (!repeat && vertex_chunk[triangle[k]] != chunk) needed++;
+            }
+
+            uint32_t used = chunked.num_vertices - chunked.chunks[chunk].first_vertex;
+            if (used + needed > max_vertices)
+            {
+                end_chunk_draw(&chunked);
+                end_chunk(&chunked);
+                begin_chunk(&chunked);
+                begin_chunk_draw(&chunked, draw);
+                chunk++;
+                used = 0;
+            }
+
+            uint32_t local[3];
+            for (int k = 0; k < 3; k++)
+            {
+                uint32_t v = triangle[k];
+                if (vertex_chunk[v] != chunk)
+                {
+                    vertex_chunk[v] = chunk;
+                    vertex_index[v] = used++;
+                    memcpy(mesh_add_vertex(&chunked), &mesh->vertices[v * mesh->stride], mesh->stride * sizeof(float));
+                }
+                local[k] = vertex_index[v];
+            }
+            mesh_add_triangle(&chunked, local[0], local[1], local[2]);
+        }
+
+        end_chunk_draw(&chunked);
+    }
+    end_chunk(&chunked);
+
+    free(vertex_chunk);
+    free(vertex_index);
+    free_mesh(mesh);
+    *mesh = chunked;
+}
@@ -0,0 +1,154 @@
+// Read-only access to Quake PAK archives, see unpak.c for the format.
+//
+// The archive is mapped rather than read, and its directory is indexed
+// by a hash table so single entries can be found without a scan.
+//
+//   pak_t pak;
+//   pak_open(&pak, "pak0.pak");
+//   const struct pak_directory* bsp = pak_find(&pak, "maps/e1m1.bsp");
+//   const char* data = pak_data(&pak, bsp);
+//   ...
+//   pak_close(&pak);
+
+struct pak_directory
+{
+    char file_name[56];
+    uint32_t file_position;
+    uint32_t file_length;
+};
+
+struct pak_header
+{
+    char signature[4];
+    uint32_t directory_offset;
+    uint32_t directory_length;
+};
+
+typedef struct
+{
+    char*                       filename;       // owned copy
+    file_view_t                 view;
+    const struct pak_directory* entries;
+    uint32_t                    num_entries;
+    uint32_t*                   buckets;        // entry index + 1, or 0 if empty
+    uint32_t                    num_buckets;    // always a power of two
+} pak_t;
+
+// FNV-1a
+static uint32_t hash_path(const char* path, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Entry names are not null terminated when they fill all 56 bytes.
+static size_t entry_name_length(const struct pak_directory* entry)
+{
+    const char* end = (const char*)memchr(entry->file_name, 0, sizeof(entry->file_name));
+    return end ? (size_t)(end - entry->file_name) : sizeof(entry->file_name);
+}
+
+// Copy the name of 'entry' into 'name', which must hold 57 bytes.
+void pak_entry_name(const struct pak_directory* entry, char* name)
+{
+    size_t length = entry_name_length(entry);
+    memcpy(name, entry->file_name, length);
+    name[length] = 0;
+}
+
+void pak_open(pak_t* pak, const char* filename)
+{
+    // Only the directory is walked through the mapping, file data
+    // is read on demand so there is no point in reading ahead.
+    pak->filename = strdup(filename);
+    pak->view = map_file(filename, MADV_RANDOM);
+
+    const struct pak_header* header = (const struct pak_header*)pak->view.data;
+
+    if (pak->view.size < sizeof(struct pak_header) || memcmp(header->signature, "PACK", 4) ||
+        (uint64_t)header->directory_offset + header->directory_length > pak->view.size)
+    {
+        fatal("Invalid pak: %s\n", filename);
+    }
+
+    pak->entries = (const struct pak_directory*)&pak->view.data[header->directory_offset];
+    pak->num_entries = header->directory_length / sizeof(struct pak_directory);
+
+    for (uint32_t i = 0; i < pak->num_entries; i++)
+    {
+        const struct pak_directory* entry = &pak->entries[i];
+        if ((uint64_t)entry->file_position + entry->file_length > pak->view.size)
+        {
+            fatal("Entry %.56s runs past the end of %s\n", entry->file_name, filename);
+        }
+    }
+
+    // Keep the table at most half full
+    pak->num_buckets = 16;
+    while (pak->num_buckets < pak->num_entries * 2) pak->num_buckets *= 2;
+    pak->buckets = (uint32_t*)calloc(pak->num_buckets, sizeof(uint32_t));
+
+    uint32_t mask = pak->num_buckets - 1;
+    for (uint32_t i = 0; i < pak->num_entries; i++)
+    {
+        const struct pak_directory* entry = &pak->entries[i];
+        size_t length = entry_name_length(entry);
+        uint32_t slot = hash_path(entry->file_name, length) & mask;
+
+        // The last of any duplicate names wins, as it does when unpacking
+        for (; pak->buckets[slot]; slot = (slot + 1) & mask)
+        {
+            const struct pak_directory* other = &pak->entries[pak->buckets[slot] - 1];
+            if (entry_name_length(other) == length && !memcmp(other->file_name, entry->file_name, length)) break;
+        }
+        pak->buckets[slot] = i + 1;
+    }
+}
+
+void pak_close(pak_t* pak)
+{
+    free(pak->buckets);
+    pak->buckets = NULL;
+    free(pak->filename);
+    pak->filename = NULL;
+    unmap_file(&pak->view);
+}
+
+// Look up an entry by its exact name, e.g. "maps/e1m1.bsp".
+const struct pak_directory* pak_find(const pak_t* pak, const char* name)
+{
+    size_t length = strlen(name);
+    if (length > sizeof(pak->entries->file_name)) return NULL;
+
+    uint32_t mask = pak->num_buckets - 1;
+    for (uint32_t slot = hash_path(name, length) & mask; pak->buckets[slot]; slot = (slot + 1) & mask)
+    {
+        const struct pak_directory* entry = &pak->entries[pak->buckets[slot] - 1];
+        if (entry_name_length(entry) == length && !memcmp(entry->file_name, name, length)) return entry;
+    }
+    return NULL;
+}
+
+// Index of the first entry from 'start' on whose name matches the
+// shell wildcard 'pattern' (e.g. "maps/e1m*.bsp"), or -1.
+int pak_glob(const pak_t* pak, const char* pattern, int start)
+{
+    for (uint32_t i = MAX(start, 0); i < pak->num_entries; i++)
+    {
+        char name[57];
+        pak_entry_name(&pak->entries[i], name);
+        if (!fnmatch(pattern, name, FNM_PATHNAME)) return i;
+    }
+    return -1;
+}
+
+// The entry's bytes, straight out of the mapping.
+const char* pak_data(const pak_t* pak, const struct pak_directory* entry)
+{
+    return pak->view.data + entry->file_position;
+}
@@ -37,108 +37,424 @@ Quake2 specifics on PAK files (content wise)  I have no clue.
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/errno.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
      
 #include "utils.c"
+#include "pak.c"
 
-struct pak_directory
+
+// Directories that have already been created, keyed on their
+// path inside the pak, so each one costs a single mkdirat/openat
+// no matter how many entries live in it.
+typedef struct
 {
-    char file_name[56];
-    uint32_t file_position;
-    uint32_t file_length;
-};
+    char path[57];
+    int  fd;
+} cached_dir_t;
 
-struct pak_header
+typedef struct
 {
-    char signature[4];
-    uint32_t directory_offset;
-    uint32_t directory_length;
-};
+    cached_dir_t* slots;
+    uint32_t      capacity;     // always a power of two
+    uint32_t      count;
+    int           root_fd;      // the output directory
+} dir_cache_t;
 
+static cached_dir_t* find_dir_slot(cached_dir_t* slots, uint32_t capacity, const char* path, size_t length)
+{
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = hash_path(path, length) & mask; ; i = (i + 1) & mask)
+    {
+        cached_dir_t* slot = &slots[i];
+        if (slot->fd < 0) return slot;
+        if (!strncmp(slot->path, path, length) && slot->path[length] == 0) return slot;
+    }
+}
+
+static void init_dir_cache(dir_cache_t* cache, int root_fd)
+{
+    cache->capacity = 64;
+    cache->count = 0;
+    cache->root_fd = root_fd;
+    cache->slots = malloc(cache->capacity * sizeof(cached_dir_t));
+    for (uint32_t i = 0; i < cache->capacity; i++) cache->slots[i].fd = -1;
+}
 
-static void open_dir(char* path)
+static void grow_dir_cache(dir_cache_t* cache)
 {
-    printf("making and entering %s\n", path);
+    cached_dir_t* old_slots = cache->slots;
+    uint32_t old_capacity = cache->capacity;
+
+    cache->capacity *= 2;
+    cache->slots = malloc(cache->capacity * sizeof(cached_dir_t));
+    for (uint32_t i = 0; i < cache->capacity; i++) cache->slots[i].fd = -1;
 
-    for(char* tok = strtok(path, "/"); tok; tok = strtok(NULL, "/"))
+    for (uint32_t i = 0; i < old_capacity; i++)
     {
-        printf("tok: %s\n", tok);
-        mkdir(tok, 0755);
-        chdir(tok);
+        cached_dir_t* old = &old_slots[i];
+        if (old->fd < 0) continue;
+        *find_dir_slot(cache->slots, cache->capacity, old->path, strlen(old->path)) = *old;
     }
+    free(old_slots);
 }
 
-// Given the path to a file
-// Open the containing folder, and return a pointer
-// the start of the file name
-// 'foo/bar/baz.bsp' =>
-//   chdir('foo/bar'); return 'baz.bsp'
-static char* create_dir_and_open(char* path)
+static void free_dir_cache(dir_cache_t* cache)
 {
-    char* last_sep = strrchr(path, '/');
-    if (!last_sep) return path;
+    for (uint32_t i = 0; i < cache->capacity; i++)
+    {
+        if (cache->slots[i].fd >= 0) close(cache->slots[i].fd);
+    }
+    free(cache->slots);
+}
 
-    // Add a null between folder and file 
-    // "foo/bar/baz.bsp" => "foo/bar" {0} "baz.bsp"
-    *last_sep = 0;
-    
-    
-    open_dir(path);
-    
-    return last_sep + 1;
+// Return a descriptor for the first 'length' characters of 'path'
+// (e.g. "foo/bar"), creating it and any missing parents on the way.
+static int open_dir(dir_cache_t* cache, const char* path, size_t length)
+{
+    if (length == 0) return cache->root_fd;
+
+    cached_dir_t* slot = find_dir_slot(cache->slots, cache->capacity, path, length);
+    if (slot->fd >= 0) return slot->fd;
+
+    // 'foo/bar' => parent 'foo', name 'bar'
+    size_t name_start = length;
+    while (name_start > 0 && path[name_start - 1] != '/') name_start--;
+    int parent_fd = open_dir(cache, path, name_start ? name_start - 1 : 0);
+
+    char name[57] = {};
+    memcpy(name, path + name_start, length - name_start);
+
+    // "foo//bar" has an empty component, which just means the parent.
+    if (!name[0]) return parent_fd;
+
+    if (mkdirat(parent_fd, name, 0755) < 0 && errno != EEXIST)
+    {
+        fatal("Error creating directory %.*s: %s\n", (int)length, path, strerror(errno));
+    }
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) fatal("Error opening directory %.*s: %s\n", (int)length, path, strerror(errno));
+
+    // The parent lookup may have grown the table under us.
+    if (cache->count + 1 > cache->capacity / 2) grow_dir_cache(cache);
+    slot = find_dir_slot(cache->slots, cache->capacity, path, length);
+
+    memset(slot->path, 0, sizeof(slot->path));
+    memcpy(slot->path, path, length);
+    slot->fd = fd;
+    cache->count++;
+    return fd;
 }
 
-static void unpack(const char* destination, const char* filename)
+static double seconds_now(void)
 {
-    char* data = read_entire_file(filename);
-    
-    struct pak_header* header = (struct pak_header*)data;
-    
-    if (memcmp(header->signature, "PACK", 4))
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Copy 'length' bytes at 'offset' in 'input' to the start of 'output'.
+// Where the kernel allows it the data never passes through user space:
+// copy_file_range first (which can share extents on some filesystems),
+// then sendfile, and plain pread/write as the last resort.
+static void copy_range(int input, int output, off_t offset, size_t length)
+{
+#ifdef __linux__
+    // Only a hint, a filesystem that can't preallocate still gets the copy
+    if (length > 0) (void)fallocate(output, 0, 0, length);
+
+    loff_t from = offset;
+    while (length > 0)
+    {
+        ssize_t copied = copy_file_range(input, &from, output, NULL, length, 0);
+        if (copied > 0) length -= copied;
+        else if (copied < 0 && errno == EINTR) continue;
+        else break;
+    }
+
+    offset = from;
+    while (length > 0)
+    {
+        ssize_t copied = sendfile(output, input, &offset, length);
+        if (copied > 0) length -= copied;
+        else if (copied < 0 && errno == EINTR) continue;
+        else break;
+    }
+#endif
+
+    char buffer[64 * 1024];
+    while (length > 0)
+    {
+        size_t chunk = MIN(length, sizeof(buffer));
+        ssize_t got = pread(input, buffer, chunk, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) fatal("Error reading pak data: %s", got ? strerror(errno) : "unexpected end of file");
+
+        for (ssize_t done = 0; done < got; )
+        {
+            ssize_t written = write(output, buffer + done, got - done);
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) fatal("Error writing pak data: %s", strerror(errno));
+            done += written;
+        }
+        offset += got;
+        length -= got;
+    }
+}
+
+// One file to be written, with its directory already created.
+typedef struct
+{
+    const struct pak_directory* directory;
+    int         dir_fd;
+    const char* file_name;      // points into 'path'
+    char        path[57];
+} extract_job_t;
+
+typedef struct
+{
+    int              input;
+    extract_job_t*   jobs;
+    uint32_t         num_jobs;
+    uint32_t         next_job;
+    pthread_mutex_t  lock;
+} extract_queue_t;
+
+static void* extract_worker(void* argument)
+{
+    extract_queue_t* queue = argument;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        uint32_t index = queue->next_job++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->num_jobs) break;
+
+        extract_job_t* job = &queue->jobs[index];
+        int output = openat(job->dir_fd, job->file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output < 0) fatal("Error opening %s for writing: %s\n", job->path, strerror(errno));
+
+        copy_range(queue->input, output, job->directory->file_position, job->directory->file_length);
+        close(output);
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    char     name[57];
+    uint32_t index;
+} named_entry_t;
+
+static int compare_named_entries(const void* a, const void* b)
+{
+    const named_entry_t* x = a;
+    const named_entry_t* y = b;
+    int order = strcmp(x->name, y->name);
+    if (order) return order;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// A pak can hold the same name more than once. As in Quake the last
+// one wins, and only it is extracted, so no two workers ever write the
+// same file. Picking any copy of a name picks the last.
+static void drop_duplicates(const pak_t* pak, uint8_t* selected)
+{
+    named_entry_t* named = malloc(pak->num_entries * sizeof(named_entry_t));
+    for (uint32_t i = 0; i < pak->num_entries; i++)
     {
-        fatal("Invalid pak: %s\n", filename);
+        pak_entry_name(&pak->entries[i], named[i].name);
+        named[i].index = i;
+    }
+    qsort(named, pak->num_entries, sizeof(named_entry_t), compare_named_entries);
+
+    for (uint32_t i = 0; i + 1 < pak->num_entries; i++)
+    {
+        if (strcmp(named[i].name, named[i + 1].name)) continue;
+        selected[named[i + 1].index] |= selected[named[i].index];
+        selected[named[i].index] = 0;
+    }
+    free(named);
+}
+
+static int has_wildcards(const char* pattern)
+{
+    return strpbrk(pattern, "*?[") != NULL;
+}
+
+static void list(const char* filename)
+{
+    pak_t pak;
+    pak_open(&pak, filename);
+
+    for (uint32_t i = 0; i < pak.num_entries; i++)
+    {
+        char name[57];
+        pak_entry_name(&pak.entries[i], name);
+        printf("%10u  %s\n", pak.entries[i].file_length, name);
     }
-        
-    struct pak_directory* directories = (struct pak_directory*) &data[header->directory_offset];
-    uint32_t num_directories = header->directory_length / sizeof(struct pak_directory);
     
-    for (uint32_t i = 0; i < num_directories; i++)
-    {        
-        chdir(destination);
+    pak_close(&pak);
+}
+
+// Extract the entries matching any of 'patterns', or all of them
+// when there are no patterns. 'matched' counts the entries each
+// pattern picked, across all the paks.
+static void unpack(dir_cache_t* dirs, const char* filename, char** patterns, int* matched, int num_patterns, int num_threads)
+{
+    pak_t pak;
+    pak_open(&pak, filename);
+
+    uint8_t* selected = calloc(pak.num_entries, 1);
+    if (!num_patterns) memset(selected, 1, pak.num_entries);
+
+    for (int p = 0; p < num_patterns; p++)
+    {
+        if (has_wildcards(patterns[p]))
+        {
+            for (int i = pak_glob(&pak, patterns[p], 0); i >= 0; i = pak_glob(&pak, patterns[p], i + 1))
+            {
+                selected[i] = 1;
+                matched[p]++;
+            }
+        }
+        else
+        {
+            const struct pak_directory* entry = pak_find(&pak, patterns[p]);
+            if (!entry) continue;
+            selected[entry - pak.entries] = 1;
+            matched[p]++;
+        }
+    }
+
+    drop_duplicates(&pak, selected);
 
-        struct pak_directory* directory = &directories[i];
-        printf("%s (%d bytes)\n", directory->file_name, directory->file_length);        
+    extract_queue_t queue;
+    queue.input = open(filename, O_RDONLY);
+    if (queue.input < 0) fatal("Error reading %s\n", filename);
+    queue.jobs = malloc(pak.num_entries * sizeof(extract_job_t));
+    queue.num_jobs = 0;
+    queue.next_job = 0;
+    pthread_mutex_init(&queue.lock, NULL);
 
-        const char* file_name = create_dir_and_open(directory->file_name);
+    double start = seconds_now();
+    uint64_t total_bytes = 0;
 
-        FILE* output = fopen(file_name, "wb");
-        if (!output) fatal("Error opening [%s] %s for writing.\n", getcwd(0,0), file_name); // leakcwd
-        
-        fwrite(&data[directory->file_position], directory->file_length, 1, output);
-        fclose(output);
+    // Directories are created up front on this thread, so the
+    // workers only ever open and fill files.
+    for (uint32_t i = 0; i < pak.num_entries; i++)
+    {
+        if (!selected[i]) continue;
+
+        const struct pak_directory* directory = &pak.entries[i];
+        extract_job_t* job = &queue.jobs[queue.num_jobs++];
+        job->directory = directory;
+        pak_entry_name(directory, job->path);
+        printf("%s (%d bytes)\n", job->path, directory->file_length);
+
+        // 'foo/bar/baz.bsp' => directory 'foo/bar', file 'baz.bsp'
+        char* last_sep = strrchr(job->path, '/');
+        job->file_name = last_sep ? last_sep + 1 : job->path;
+        job->dir_fd = open_dir(dirs, job->path, last_sep ? last_sep - job->path : 0);
+
+        total_bytes += directory->file_length;
+    }
+
+    num_threads = MAX(1, MIN(num_threads, (int)queue.num_jobs));
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    for (int i = 1; i < num_threads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, extract_worker, &queue)) fatal("Unable to start thread");
     }
+    extract_worker(&queue);
+    for (int i = 1; i < num_threads; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    double elapsed = seconds_now() - start;
+    double megabytes = total_bytes / (1024.0 * 1024.0);
+    printf("Extracted %u files, %.1f MB in %.3f s (%.1f MB/s)\n",
+        queue.num_jobs, megabytes, elapsed, elapsed > 0 ? megabytes / elapsed : 0);
     
-    free(data);
+    pthread_mutex_destroy(&queue.lock);
+    free(queue.jobs);
+    free(selected);
+    close(queue.input);
+    pak_close(&pak);
+}
+
+static void usage(const char* program)
+{
+    fatal("Usage: %s [-j threads] [--list] [--extract <name or pattern>]... <filename.pak>...\n", program);
 }
 
 int main(int argc, char** argv)
 {
-    if (argc < 2) fatal("Usage: %s <filename.pak>\n", argv[0]);
-    
-    mkdir("output", 0755);
-    chdir("output");
+    static const struct option options[] =
+    {
+        { "list",    no_argument,       NULL, 'l' },
+        { "extract", required_argument, NULL, 'x' },
+        { NULL,      0,                 NULL, 0   }
+    };
+
+    int num_threads = 1;
+    int list_only = 0;
+    char** patterns = malloc(argc * sizeof(char*));
+    int num_patterns = 0;
     
-    // Store the current working directory for jumping back to later        
-    char* cwd = getcwd(0, 0); // leaks
-    puts(cwd);
+    for (int option; (option = getopt_long(argc, argv, "j:lx:", options, NULL)) != -1; )
+    {
+        switch (option)
+        {
+            case 'j': num_threads = atoi(optarg); break;
+            case 'l': list_only = 1; break;
+            case 'x': patterns[num_patterns++] = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || num_threads < 1) usage(argv[0]);
 
-    for (int i=1; i<argc; i++) unpack(cwd, argv[i]);
+    if (list_only)
+    {
+        for (int i=optind; i<argc; i++) list(argv[i]);
+        return EXIT_SUCCESS;
+    }
     
-    return EXIT_SUCCESS;
-}
+    mkdir("output", 0755);
+    int output = open("output", O_RDONLY | O_DIRECTORY);
+    if (output < 0) fatal("Error opening output directory: %s\n", strerror(errno));
 
+    dir_cache_t dirs;
+    init_dir_cache(&dirs, output);
 
+    int* matched = calloc(num_patterns + 1, sizeof(int));
+    for (int i=optind; i<argc; i++) unpack(&dirs, argv[i], patterns, matched, num_patterns, num_threads);
 
+    // A name may live in any one of the paks, so only one that's in
+    // none of them is an error
+    for (int p = 0; p < num_patterns; p++)
+    {
+        if (matched[p]) continue;
+        if (has_wildcards(patterns[p])) fprintf(stderr, "Warning: nothing matches %s\n", patterns[p]);
+        else fatal("No %s in any of the paks", patterns[p]);
+    }
 
+    free_dir_cache(&dirs);
+    close(output);
+    free(matched);
+    free(patterns);
+    
+    return EXIT_SUCCESS;
+}
@@ -9,15 +9,45 @@ static void fatal(const char* message, ...)
     exit(EXIT_FAILURE);
 }
 
-static char* read_entire_file(const char* filename)
+// A read-only view of a whole file, backed by mmap so that
+// data is paged in from the page cache as it is touched rather
+// than copied onto the heap up front.
+typedef struct
 {
-    FILE* input = fopen(filename, "rb");
-    if (!input) fatal("Error reading %s\n", filename);
-    fseek(input, 0, SEEK_END);
-    long size = ftell(input);
-    char* data = malloc(size);
-    rewind(input);
-    fread(data, size, 1, input);
-    fclose(input);
-    return data;
+    char*  data;
+    size_t size;
+} file_view_t;
+
+// 'advice' is one of the MADV_* hints describing how the
+// caller intends to walk the file (e.g. MADV_SEQUENTIAL).
+static file_view_t map_file(const char* filename, int advice)
+{
+    file_view_t view = { NULL, 0 };
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) fatal("Error reading %s\n", filename);
+
+    struct stat info;
+    if (fstat(fd, &info) < 0) fatal("Error reading %s\n", filename);
+    view.size = (size_t)info.st_size;
+
+    // mmap refuses zero length mappings
+    if (view.size > 0)
+    {
+        void* data = mmap(NULL, view.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) fatal("Error mapping %s\n", filename);
+        madvise(data, view.size, advice);
+        view.data = (char*)data;
+    }
+
+    // The mapping holds its own reference to the file
+    close(fd);
+    return view;
+}
+
+static void unmap_file(file_view_t* view)
+{
+    if (view->data) munmap(view->data, view->size);
+    view->data = NULL;
+    view->size = 0;
 }
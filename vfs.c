@@ -0,0 +1,123 @@
+// Resolves the file names handed to the converters to bytes in memory,
+// Quake style. A name is either
+//
+//   maps/e1m1.bsp            a loose file if there is one, otherwise the
+//                            entry of that name in the newest pak on the
+//                            search path
+//   pak0.pak:maps/e1m1.bsp   the entry in that particular archive, which
+//                            is also added to the search path
+//
+// Entries in paks are never copied, 'data' points into the archive.
+
+typedef struct
+{
+    pak_t** paks;           // search path, oldest first
+    int     num_paks;
+} vfs_t;
+
+typedef struct
+{
+    const char*  data;
+    size_t       size;
+    const pak_t* pak;       // archive holding the data, NULL for loose files
+    char         entry_name[57];
+    file_view_t  view;      // mapping of a loose file
+} vfs_file_t;
+
+void vfs_init(vfs_t* vfs)
+{
+    vfs->paks = NULL;
+    vfs->num_paks = 0;
+}
+
+// Add an archive to the end of the search path, so it takes priority
+// over those added before it. Archives are only ever opened once.
+pak_t* vfs_add_pak(vfs_t* vfs, const char* filename)
+{
+    for (int i = 0; i < vfs->num_paks; i++)
+    {
+        if (!strcmp(vfs->paks[i]->filename, filename)) return vfs->paks[i];
+    }
+
+    pak_t* pak = (pak_t*)malloc(sizeof(pak_t));
+    pak_open(pak, filename);
+
+    vfs->paks = (pak_t**)realloc(vfs->paks, (vfs->num_paks + 1) * sizeof(pak_t*));
+    vfs->paks[vfs->num_paks++] = pak;
+    return pak;
+}
+
+void vfs_close(vfs_t* vfs)
+{
+    for (int i = 0; i < vfs->num_paks; i++)
+    {
+        pak_close(vfs->paks[i]);
+        free(vfs->paks[i]);
+    }
+    free(vfs->paks);
+    vfs_init(vfs);
+}
+
+static void open_entry(vfs_file_t* file, const pak_t* pak, const struct pak_directory* entry, int advice)
+{
+    file->pak = pak;
+    file->data = pak_data(pak, entry);
+    file->size = entry->file_length;
+    pak_entry_name(entry, file->entry_name);
+
+    // The archive as a whole is mapped for random access, pass the
+    // caller's hint on for just the pages holding this entry.
+    if (file->size > 0)
+    {
+        uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)file->data & ~(page_size - 1);
+        madvise((void*)start, (uintptr_t)file->data + file->size - start, advice);
+    }
+}
+
+// Returns 0 if 'name' can't be found, 'advice' is an MADV_* hint as
+// for map_file().
+int vfs_open(vfs_t* vfs, const char* name, vfs_file_t* file, int advice)
+{
+    memset(file, 0, sizeof(vfs_file_t));
+
+    const char* separator = strstr(name, ".pak:");
+    if (separator)
+    {
+        separator += strlen(".pak");
+
+        char* archive = strndup(name, separator - name);
+        pak_t* pak = vfs_add_pak(vfs, archive);
+        free(archive);
+
+        const struct pak_directory* entry = pak_find(pak, separator + 1);
+        if (!entry) return 0;
+        open_entry(file, pak, entry, advice);
+        return 1;
+    }
+
+    if (!access(name, R_OK))
+    {
+        file->view = map_file(name, advice);
+        file->data = file->view.data;
+        file->size = file->view.size;
+        return 1;
+    }
+
+    for (int i = vfs->num_paks - 1; i >= 0; i--)
+    {
+        const struct pak_directory* entry = pak_find(vfs->paks[i], name);
+        if (!entry) continue;
+        open_entry(file, vfs->paks[i], entry, advice);
+        return 1;
+    }
+
+    return 0;
+}
+
+void vfs_close_file(vfs_file_t* file)
+{
+    unmap_file(&file->view);
+    file->data = NULL;
+    file->size = 0;
+}
@@ -0,0 +1,183 @@
+// Buffered output for the converters.
+//
+// Output is appended to a large buffer that goes to the file in one
+// write() when it fills up or the writer is closed, so formatting a
+// vertex costs a memcpy rather than a locked stdio call. Blocks bigger
+// than the buffer are not copied at all, they go out together with
+// whatever is pending in a single writev().
+//
+// Several files can share one descriptor, e.g. a pipe, when they are
+// opened with writer_open_framed(). Each write then goes out as a
+// record, a "<size> <name>\n" line and that many bytes. One file may
+// take several records, to be joined in order, and an empty file is a
+// single record of size 0.
+//
+//   writer_t out;
+//   writer_open(&out, "e1m1.bsp.vertices.json");
+//   writer_printf(&out, "{ \"vertices\" : [ ");
+//   ...
+//   writer_close(&out);
+
+#define WRITER_BUFFER_SIZE (1 << 20)
+
+typedef struct
+{
+    int      fd;
+    int      owns_fd;           // close fd along with the writer
+    int      framed;            // writes go out as records, see above
+    char*    filename;          // for error messages
+    char*    data;
+    size_t   used;
+    size_t   capacity;
+    uint64_t bytes;             // total written through this writer
+} writer_t;
+
+// Write all of 'iov', retrying after short writes and interrupts.
+static void write_fully(writer_t* writer, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(writer->fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            fatal("Error writing %s", writer->filename);
+        }
+        writer->bytes += written;
+
+        for (; count > 0 && (size_t)written >= iov->iov_len; iov++, count--) written -= iov->iov_len;
+        if (count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Write 'iov' as one record of a framed writer, header first.
+static void write_record(writer_t* writer, struct iovec* iov, int count)
+{
+    size_t size = 0;
+    for (int i = 0; i < count; i++) size += iov[i].iov_len;
+
+    char prefix[32];
+    int length = snprintf(prefix, sizeof(prefix), "%zu ", size);
+    struct iovec record[5] = { { prefix, length }, { writer->filename, strlen(writer->filename) }, { (void*)"\n", 1 } };
+    memcpy(&record[3], iov, count * sizeof(struct iovec));
+    write_fully(writer, record, 3 + count);
+
+    // Only the file's own bytes count
+    writer->bytes -= record[0].iov_len + record[1].iov_len + record[2].iov_len;
+}
+
+// Write 'iov', which is at most 2 blocks, to the file.
+static void write_blocks(writer_t* writer, struct iovec* iov, int count)
+{
+    if (!writer->framed) write_fully(writer, iov, count);
+    else if (iov[0].iov_len || (count > 1 && iov[1].iov_len)) write_record(writer, iov, count);
+}
+
+// Write to 'fd', which stays open after writer_close().
+void writer_open_fd(writer_t* writer, int fd, const char* name)
+{
+    writer->fd = fd;
+    writer->owns_fd = 0;
+    writer->framed = 0;
+    writer->filename = strdup(name);
+    writer->capacity = WRITER_BUFFER_SIZE;
+    writer->data = (char*)malloc(writer->capacity);
+    writer->used = 0;
+    writer->bytes = 0;
+}
+
+void writer_open(writer_t* writer, const char* filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) fatal("Error opening %s", filename);
+    writer_open_fd(writer, fd, filename);
+    writer->owns_fd = 1;
+}
+
+// Like writer_open_fd(), for one of several files sharing 'fd'.
+void writer_open_framed(writer_t* writer, int fd, const char* name)
+{
+    writer_open_fd(writer, fd, name);
+    writer->framed = 1;
+}
+
+void writer_flush(writer_t* writer)
+{
+    struct iovec iov = { writer->data, writer->used };
+    write_blocks(writer, &iov, 1);
+    writer->used = 0;
+}
+
+// Room for at least 'size' bytes at the end of the buffer, which
+// writer_commit() then appends.
+char* writer_reserve(writer_t* writer, size_t size)
+{
+    if (writer->used + size > writer->capacity)
+    {
+        writer_flush(writer);
+        if (size > writer->capacity)
+        {
+            writer->capacity = size;
+            writer->data = (char*)realloc(writer->data, writer->capacity);
+        }
+    }
+    return &writer->data[writer->used];
+}
+
+void writer_commit(writer_t* writer, size_t size)
+{
+    writer->used += size;
+}
+
+void writer_write(writer_t* writer, const void* data, size_t size)
+{
+    if (writer->used + size <= writer->capacity)
+    {
+        memcpy(&writer->data[writer->used], data, size);
+        writer->used += size;
+        return;
+    }
+
+    struct iovec iov[2] = { { writer->data, writer->used }, { (void*)data, size } };
+    write_blocks(writer, iov, 2);
+    writer->used = 0;
+}
+
+void writer_printf(writer_t* writer, const char* format, ...)
+{
+    va_list argp;
+    va_start(argp, format);
+    size_t room = writer->capacity - writer->used;
+    int length = vsnprintf(&writer->data[writer->used], room, format, argp);
+    va_end(argp);
+
+    if (length < 0) fatal("Error formatting output for %s", writer->filename);
+    if ((size_t)length >= room)
+    {
+        // Didn't fit, try again after making room
+        va_start(argp, format);
+        vsnprintf(writer_reserve(writer, length + 1), length + 1, format, argp);
+        va_end(argp);
+    }
+    writer->used += length;
+}
+
+// Flush, and close the file unless it was handed to writer_open_fd().
+void writer_close(writer_t* writer)
+{
+    writer_flush(writer);
+    if (writer->framed && !writer->bytes)
+    {
+        struct iovec none = { writer->data, 0 };
+        write_record(writer, &none, 1);
+    }
+    if (writer->owns_fd) close(writer->fd);
+    free(writer->data);
+    free(writer->filename);
+    writer->data = NULL;
+    writer->filename = NULL;
+}